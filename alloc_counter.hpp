@@ -0,0 +1,95 @@
+#pragma once
+#ifndef ALLOC_COUNTER_HPP__
+#define ALLOC_COUNTER_HPP__
+
+// heap allocations per decoded frame, for benchmarking the hot path.
+// only active when built with PROXY_COUNT_ALLOCS (cmake -DCOUNT_ALLOCS=ON);
+// include from one translation unit only, it replaces operator new/delete.
+
+#include "basic.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+namespace basic::alloc_counter
+{
+
+inline std::atomic<std::uint64_t> allocations{0};
+inline std::atomic<std::uint64_t> frames{0};
+
+inline void count_frame()
+{
+#ifdef PROXY_COUNT_ALLOCS
+    frames.fetch_add(1, std::memory_order_relaxed);
+#endif // PROXY_COUNT_ALLOCS
+}
+
+class reporter : public std::enable_shared_from_this<reporter>
+{
+    net::steady_timer timer_;
+    std::chrono::seconds const interval_;
+    std::uint64_t last_allocations_ = 0;
+    std::uint64_t last_frames_ = 0;
+
+public:
+    reporter(net::io_context& io, std::chrono::seconds interval):
+        timer_{io}, interval_{interval} {}
+
+    void report()
+    {
+        std::uint64_t const a = allocations.load(std::memory_order_relaxed);
+        std::uint64_t const f = frames.load(std::memory_order_relaxed);
+        std::uint64_t const da = a - last_allocations_, df = f - last_frames_;
+        last_allocations_ = a;
+        last_frames_ = f;
+
+        if (df != 0)
+            BOOST_LOG_TRIVIAL(info) << "alloc_counter frames=" << df << " allocations=" << da
+                                    << " per frame=" << static_cast<double>(da) / df;
+    }
+
+    void start_report()
+    {
+        timer_.expires_after(interval_);
+        timer_.async_wait(
+            [self=shared_from_this()] (boost::system::error_code ec) {
+                if (ec)
+                    return;
+                self->report();
+                self->start_report();
+            });
+    }
+};
+
+} // namespace basic::alloc_counter
+
+#ifdef PROXY_COUNT_ALLOCS
+
+void* operator new(std::size_t size)
+{
+    basic::alloc_counter::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0? 1: size))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) { return ::operator new(size); }
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+    basic::alloc_counter::allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size == 0? 1: size);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const& tag) noexcept { return ::operator new(size, tag); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+#endif // PROXY_COUNT_ALLOCS
+
+#endif // ALLOC_COUNTER_HPP__
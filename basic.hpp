@@ -69,6 +69,16 @@ using namespace std::string_literals;
 namespace basic
 {
 
+#ifdef SO_REUSEPORT
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#else
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEADDR>;
+#endif // SO_REUSEPORT
+
+// client and worker connections: tcp, or a unix domain socket for peers
+// on the same host. both convert to it by move
+using stream_socket = net::generic::stream_protocol::socket;
+
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
@@ -0,0 +1,375 @@
+#pragma once
+#ifndef BUFFER_POOL_HPP__
+#define BUFFER_POOL_HPP__
+
+#include "numa.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <bit>
+#include <mutex>
+#include <new>
+
+namespace pack
+{
+
+// leaves elements uninitialized on resize(); bodies are always
+// overwritten by a socket read right after they are sized
+template<typename T, typename Allocator = std::allocator<T>>
+class default_init_allocator : public Allocator
+{
+    using traits = std::allocator_traits<Allocator>;
+
+public:
+    template<typename U>
+    struct rebind
+    {
+        using other = default_init_allocator<U, typename traits::template rebind_alloc<U>>;
+    };
+
+    using Allocator::Allocator;
+
+    template<typename U>
+    void construct(U* ptr) noexcept(std::is_nothrow_default_constructible_v<U>)
+    {
+        ::new(static_cast<void*>(ptr)) U;
+    }
+
+    template<typename U, typename ... Args>
+    void construct(U* ptr, Args && ... args)
+    {
+        traits::construct(static_cast<Allocator&>(*this), ptr, std::forward<Args>(args)...);
+    }
+};
+
+template<typename Unit>
+using buffer = std::vector<Unit, default_init_allocator<Unit>>;
+
+// size-classed free lists (powers of 2) of body buffers.
+// lists are thread_local so acquire/release rarely lock: only a thread
+// whose list overflows or runs dry trades half a list with the shared
+// depot, which keeps pools balanced when bodies are read on one thread
+// and released by a write completing on another. there is a depot per
+// numa node, so buffers only move between threads of the same node.
+// what a thread and a depot keep is capped in bytes as well as in
+// buffers, so a burst of big bodies is given back to the OS once it is
+// over instead of staying cached in every thread that saw it.
+template<typename Unit>
+class buffer_pool
+{
+    static constexpr std::size_t min_shift = 6;  // 64 B
+    static constexpr std::size_t max_shift = 24; // 16 MiB; bigger bodies bypass the pool
+    static constexpr std::size_t classes = max_shift - min_shift + 1;
+    static constexpr std::size_t cached_bytes_per_class = 16 << 20;
+    static constexpr std::size_t max_cached_per_class = 256;
+    static constexpr std::size_t max_cached_bytes = 32 << 20;  // per thread, all classes
+    static constexpr std::size_t depot_factor = 4; // depot limit = 4 thread limits
+    static constexpr std::size_t max_depot_bytes = depot_factor * max_cached_bytes; // per node
+
+    using freelist = std::vector<buffer<Unit>>;
+
+    struct depot
+    {
+        std::mutex mutex;
+        freelist list;
+    };
+
+    struct node_depots
+    {
+        std::array<depot, classes> lists;
+        std::atomic<std::size_t> bytes = 0;
+    };
+
+    // the thread's lists. on thread exit they go to the depot as far as
+    // it has room; the flag below outlives them, so a buffer released
+    // later in the exit (by another thread_local's destructor) goes
+    // straight to the depot instead of to a destroyed list
+    struct cache
+    {
+        std::array<freelist, classes> lists;
+        std::size_t bytes = 0;
+
+        ~cache()
+        {
+            exited() = true;
+            for (std::size_t cls = 0; cls < classes; cls++)
+                give_back(cls, lists[cls], lists[cls].size());
+        }
+    };
+
+    static auto exited() -> bool&
+    {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    // null once the calling thread is exiting
+    static auto local() -> cache*
+    {
+        if (exited())
+            return nullptr;
+        static thread_local cache c;
+        return &c;
+    }
+
+    // the depots of the calling thread's node
+    static auto shared() -> node_depots&
+    {
+        static std::array<node_depots, basic::numa::max_nodes> depots;
+        return depots[basic::numa::depot_index()];
+    }
+
+    // moves up to n buffers; returns their bytes
+    static auto transfer(freelist& from, freelist& to, std::size_t n) -> std::size_t
+    {
+        std::size_t bytes = 0;
+        for (; n != 0 and not from.empty(); n--)
+        {
+            bytes += from.back().capacity();
+            to.push_back(std::move(from.back()));
+            from.pop_back();
+        }
+        return bytes;
+    }
+
+    // moves up to n buffers of a class from a thread to the depot while
+    // it has room, frees the rest of the n; returns the bytes that left
+    static auto give_back(std::size_t cls, freelist& from, std::size_t n) -> std::size_t
+    {
+        node_depots& nd = shared();
+        depot& d = nd.lists[cls];
+        std::size_t bytes = 0;
+        std::scoped_lock lock{d.mutex};
+        for (; n != 0 and not from.empty(); n--)
+        {
+            std::size_t const size = from.back().capacity();
+            bytes += size;
+            if (d.list.size() < limit(cls) * depot_factor and
+                nd.bytes.load(std::memory_order_relaxed) + size <= max_depot_bytes)
+            {
+                nd.bytes.fetch_add(size, std::memory_order_relaxed);
+                d.list.push_back(std::move(from.back()));
+            }
+            from.pop_back();
+        }
+        return bytes;
+    }
+
+    // gives buffers back until the thread is under its byte cap: of the
+    // class just released first, then of the biggest classes
+    static void trim(cache& c, std::size_t first)
+    {
+        auto drain = [&c](std::size_t cls) {
+            freelist& list = c.lists[cls];
+            while (c.bytes > max_cached_bytes and not list.empty())
+                c.bytes -= give_back(cls, list, 1);
+        };
+        drain(first);
+        for (std::size_t cls = classes; cls-- != 0 and c.bytes > max_cached_bytes;)
+            drain(cls);
+    }
+
+    static constexpr auto limit(std::size_t cls) -> std::size_t
+    {
+        return std::clamp<std::size_t>(cached_bytes_per_class >> (cls + min_shift), 1, max_cached_per_class);
+    }
+
+public:
+    static auto acquire(std::size_t size) -> buffer<Unit>
+    {
+        buffer<Unit> b;
+        if (size == 0)
+            return b;
+
+        std::size_t const shift = std::max<std::size_t>(std::bit_width(size - 1), min_shift);
+        if (shift > max_shift)
+        {
+            b.resize(size);
+            return b;
+        }
+
+        std::size_t const cls = shift - min_shift;
+        cache* c = local();
+        if (c == nullptr)
+        {
+            b.resize(size);
+            return b;
+        }
+
+        freelist& list = c->lists[cls];
+        if (list.empty())
+        {
+            node_depots& nd = shared();
+            depot& d = nd.lists[cls];
+            std::scoped_lock lock{d.mutex};
+            // one at least, as it is taken right away
+            std::size_t const room = (max_cached_bytes - std::min(c->bytes, max_cached_bytes)) >> shift;
+            std::size_t const n = std::clamp<std::size_t>(room, 1, limit(cls) / 2 + 1);
+            std::size_t const bytes = transfer(d.list, list, n);
+            nd.bytes.fetch_sub(bytes, std::memory_order_relaxed);
+            c->bytes += bytes;
+        }
+
+        if (list.empty())
+            b.reserve(std::size_t{1} << shift);
+        else
+        {
+            b = std::move(list.back());
+            list.pop_back();
+            c->bytes -= b.capacity();
+        }
+        b.resize(size);
+        return b;
+    }
+
+    static void release(buffer<Unit>&& b)
+    {
+        std::size_t const capacity = b.capacity();
+        if (capacity < (std::size_t{1} << min_shift))
+            return;
+
+        std::size_t const shift = std::bit_width(capacity) - 1;
+        if (shift > max_shift)
+            return;
+
+        b.clear();
+        std::size_t const cls = shift - min_shift;
+        cache* c = local();
+        if (c == nullptr)
+        {
+            freelist one;
+            one.push_back(std::move(b));
+            give_back(cls, one, 1);
+            return;
+        }
+
+        freelist& list = c->lists[cls];
+        if (list.size() >= limit(cls))
+            c->bytes -= give_back(cls, list, limit(cls) / 2 + 1);
+
+        list.push_back(std::move(b));
+        c->bytes += capacity;
+
+        trim(*c, cls);
+    }
+};
+
+// per-type free list for single objects: packets, their control blocks,
+// job and handler storage. a block freed on another thread joins that
+// thread's list; lists trade half their blocks with the depot of their
+// numa node when they overflow or run dry, like buffer_pool. lists are trivially
+// destructible on purpose, so blocks released during thread exit never
+// touch a destroyed list; whatever is cached then is left to the OS.
+template<typename T>
+class recycling_allocator
+{
+    struct node { node* next; };
+    struct freelist
+    {
+        node* head = nullptr;
+        std::size_t size = 0;
+    };
+
+    struct depot
+    {
+        std::mutex mutex;
+        freelist list;
+    };
+
+    static constexpr std::size_t block_size = std::max(sizeof(T), sizeof(node));
+    static constexpr std::size_t max_cached = 1024;
+    static constexpr std::size_t max_depot = 4 * max_cached;
+
+    static auto local() -> freelist&
+    {
+        static thread_local freelist list;
+        return list;
+    }
+
+    static auto shared() -> depot&
+    {
+        static std::array<depot, basic::numa::max_nodes> depots;
+        return depots[basic::numa::depot_index()];
+    }
+
+    static void transfer(freelist& from, freelist& to, std::size_t n)
+    {
+        for (; n != 0 and from.head != nullptr; n--)
+        {
+            node* moved = from.head;
+            from.head = moved->next;
+            from.size--;
+            moved->next = to.head;
+            to.head = moved;
+            to.size++;
+        }
+    }
+
+public:
+    using value_type = T;
+
+    recycling_allocator() noexcept = default;
+
+    template<typename U>
+    recycling_allocator(recycling_allocator<U> const&) noexcept {}
+
+    auto allocate(std::size_t n) -> T*
+    {
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+
+        freelist& list = local();
+        if (list.head == nullptr)
+        {
+            depot& d = shared();
+            std::scoped_lock lock{d.mutex};
+            transfer(d.list, list, max_cached / 2);
+        }
+
+        if (list.head == nullptr)
+            return static_cast<T*>(::operator new(block_size));
+
+        node* n0 = list.head;
+        list.head = n0->next;
+        list.size--;
+        return reinterpret_cast<T*>(n0);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        if (n != 1)
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        freelist& list = local();
+        if (list.size >= max_cached)
+        {
+            depot& d = shared();
+            std::scoped_lock lock{d.mutex};
+            if (d.list.size < max_depot)
+                transfer(list, d.list, max_cached / 2);
+        }
+
+        if (list.size >= max_cached)
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        list.head = ::new (static_cast<void*>(p)) node{list.head};
+        list.size++;
+    }
+
+    template<typename U>
+    bool operator== (recycling_allocator<U> const&) const noexcept { return true; }
+};
+
+} // namespace pack
+
+#endif // BUFFER_POOL_HPP__
@@ -0,0 +1,65 @@
+#pragma once
+#ifndef BUSY_POLL_HPP__
+#define BUSY_POLL_HPP__
+
+#include "basic.hpp"
+
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace basic
+{
+
+#ifdef SO_BUSY_POLL
+// microseconds the kernel busy waits on the device queue for a blocking
+// read or poll of this socket. raising it past net.core.busy_read needs CAP_NET_ADMIN
+using socket_busy_poll = net::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>;
+#endif // SO_BUSY_POLL
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// io.run(), except that the thread spins on io.poll() for up to spin
+// after the last handler it ran before it blocks in run_one(). the
+// wakeup from epoll_wait is skipped for anything that comes in while
+// spinning, at the price of a busy core. spin == 0 is plain io.run()
+inline void run_busy_polling(net::io_context& io, std::chrono::microseconds spin)
+{
+    if (spin.count() == 0)
+    {
+        io.run();
+        return;
+    }
+
+    using clock = std::chrono::steady_clock;
+    for (;;)
+    {
+        auto deadline = clock::now() + spin;
+        while (not io.stopped())
+        {
+            if (io.poll() != 0)
+                deadline = clock::now() + spin;
+            else if (clock::now() >= deadline)
+                break;
+            else
+                cpu_relax();
+        }
+
+        // stopped, or out of work: poll() stops io once nothing is left
+        if (io.stopped() or io.run_one() == 0)
+            return;
+    }
+}
+
+} // namespace basic
+
+#endif // BUSY_POLL_HPP__
@@ -28,13 +28,28 @@ auto record(Function &&f, std::string memo = "") -> long int
     return relativetime;
 }
 
-int main()
+// prints the p50/p99/p99.9 of samples in ns; reorders samples
+void percentiles(std::vector<long int>& samples, std::string const& memo)
 {
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples] (double p) { return samples[static_cast<std::size_t>(p * (samples.size() - 1))]; };
+    std::cout << memo << " p50 " << at(0.5) << " ns, p99 " << at(0.99) << " ns, p99.9 " << at(0.999) << " ns\n";
+}
+
+// usage: client [host] [port]
+int main(int argc, char* argv[])
+{
+    std::string const host = (argc > 1)? argv[1]: "localhost";
+    std::string const port = (argc > 2)? argv[2]: "12000";
+
     basic::init_log();
     boost::asio::io_context io_context;
     tcp::socket s(io_context);
     tcp::resolver resolver(io_context);
-    boost::asio::connect(s, resolver.resolve("zion01", "12000"));
+    boost::asio::connect(s, resolver.resolve(host, port));
+    s.set_option(tcp::no_delay(true));
 
     record([&](){ ; }, "base");
 
@@ -48,14 +63,14 @@ int main()
     int const times = 10000;
 
     {
-        BOOST_LOG_TRIVIAL(trace) << "connecting to zion01:12000";
+        BOOST_LOG_TRIVIAL(trace) << "connecting to " << host << ":" << port;
         std::random_device rd;
         std::mt19937 gen(rd());
         std::uniform_int_distribution<pack::unit_t> distrib(1, 6);
 
-        std::generate_n(std::back_inserter(ptr->data.buf), 4, [&] { return distrib(gen); });
+        std::generate_n(ptr->data.allocate(4), 4, [&] { return distrib(gen); });
 
-        BOOST_LOG_TRIVIAL(trace) << "writinging to zion01:12000";
+        BOOST_LOG_TRIVIAL(trace) << "writing to " << host << ":" << port;
 
         long int put_write_counter = 0;
         long int put_read_counter = 0;
@@ -64,6 +79,9 @@ int main()
         long int get_header_read_counter = 0;
         long int get_body_read_counter = 0;
         long int get = 0;
+        std::vector<long int> put_samples, get_samples;
+        put_samples.reserve(times);
+        get_samples.reserve(times);
 
         for (int i = 0; i < times; i++)
         {
@@ -85,6 +103,7 @@ int main()
             put_read_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(treadend - treadstart).count();
 
             put += std::chrono::duration_cast<std::chrono::nanoseconds>(treadend - tstart).count();
+            put_samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(treadend - tstart).count());
 
             resp->header.parse(headerbuf.data());
             BOOST_LOG_TRIVIAL(debug) << resp->header;
@@ -125,6 +144,7 @@ int main()
                 get_body_read_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(tgetbody_readend - tgetbody_readstart).count();
                 resp->data.parse(resp->header.datasize, bodybuf.data());
                 get += std::chrono::duration_cast<std::chrono::nanoseconds>(tgetbody_readend - tgetstart).count();
+                get_samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(tgetbody_readend - tgetstart).count());
             }
         }
 
@@ -135,6 +155,8 @@ int main()
         std::cout << "get_header_read_counter " << get_header_read_counter / times << " ns\n";
         std::cout << "get_body_read_counter " << get_body_read_counter / times << " ns\n";
         std::cout << "get " << get / times << " ns\n";
+        percentiles(put_samples, "put");
+        percentiles(get_samples, "get");
     }
 
 
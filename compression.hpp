@@ -0,0 +1,57 @@
+#pragma once
+#ifndef COMPRESSION_HPP__
+#define COMPRESSION_HPP__
+
+#include "serializer.hpp"
+
+#include <zstd.h>
+
+#include <limits>
+#include <memory>
+
+namespace pack
+{
+
+namespace
+{
+
+struct zstd_context
+{
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx {ZSTD_createDCtx(), ZSTD_freeDCtx};
+};
+
+auto local_zstd_context() -> zstd_context&
+{
+    static thread_local zstd_context ctx;
+    return ctx;
+}
+
+} // namespace
+
+// largest body a compressed one may expand to (--max-decompressed-size);
+// the content size is client supplied, so it is checked before anything is
+// allocated. set once before the io threads start; never above datasize
+inline std::uint64_t max_decompressed_size = 64 << 20;
+
+bool decompress(packet_data const& in, packet_data& out)
+{
+    unsigned long long const size = ZSTD_getFrameContentSize(in.buf.data(), in.buf.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR or
+        size == ZSTD_CONTENTSIZE_UNKNOWN or
+        size > max_decompressed_size)
+        return false;
+
+    unit_t* const pos = out.allocate(size);
+    std::size_t const result = ZSTD_decompressDCtx(local_zstd_context().dctx.get(),
+                                                   pos, out.buf.size(),
+                                                   in.buf.data(), in.buf.size());
+    if (ZSTD_isError(result) or result != size)
+        return false;
+
+    out.compressed = false;
+    return true;
+}
+
+} // namespace pack
+
+#endif // COMPRESSION_HPP__
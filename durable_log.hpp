@@ -0,0 +1,665 @@
+#pragma once
+#ifndef DURABLE_LOG_HPP__
+#define DURABLE_LOG_HPP__
+
+#include "basic.hpp"
+#include "serializer.hpp"
+#include "topic_table.hpp"
+
+#include <boost/crc.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace basic
+{
+
+// every record on disk is this header, then size body bytes, padded to 8.
+// a put carries a message; a consume says the put with its seq is gone
+struct log_record
+{
+    static constexpr std::uint32_t magic_value = 0x474c5850; // "PXLG"
+    enum class kind : std::uint8_t { put = 1, consume = 2 };
+
+    std::uint32_t magic;
+    std::uint32_t checksum; // crc32 of the rest of the header and the body
+    std::uint64_t seq;
+    std::uint32_t size;
+    std::uint32_t salt;
+    kind type;
+    std::uint8_t compressed;
+    std::uint8_t reserved[6];
+    pack::key_t key;
+
+    static constexpr auto padded(std::size_t body) -> std::size_t { return (sizeof(log_record) + body + 7) / 8 * 8; }
+
+    auto compute_checksum(pack::unit_t const* body) const -> std::uint32_t
+    {
+        constexpr std::size_t from = offsetof(log_record, seq);
+        boost::crc_32_type crc;
+        crc.process_bytes(reinterpret_cast<unsigned char const*>(this) + from, sizeof(log_record) - from);
+        crc.process_bytes(body, size);
+        return crc.checksum();
+    }
+};
+
+static_assert(sizeof(log_record) == 64);
+
+// one file of the log, mapped whole. the file is made at its full size
+// up front, so past end() it reads as zeros, which no record starts with
+class log_segment
+{
+    std::uint64_t id_;
+    std::filesystem::path path_;
+    int fd_;
+    pack::unit_t* map_;
+    std::size_t capacity_;
+    std::size_t end_ = 0;
+    std::size_t synced_ = 0;
+
+    log_segment(std::uint64_t id, std::filesystem::path path, int fd, pack::unit_t* map, std::size_t capacity):
+        id_{id}, path_{std::move(path)}, fd_{fd}, map_{map}, capacity_{capacity} {}
+
+    static auto map(std::uint64_t id, std::filesystem::path const& path, int fd, std::size_t capacity) -> std::unique_ptr<log_segment>
+    {
+        pack::unit_t* map = nullptr;
+        if (capacity != 0)
+        {
+            void* const p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                BOOST_LOG_TRIVIAL(error) << "durable_log mmap " << path << ": " << std::strerror(errno);
+                ::close(fd);
+                return nullptr;
+            }
+            map = static_cast<pack::unit_t*>(p);
+        }
+        return std::unique_ptr<log_segment>(new log_segment{id, path, fd, map, capacity});
+    }
+
+    // reserves the blocks up front where it can, so syncs do not allocate them
+    static int allocate(int fd, std::size_t capacity)
+    {
+#ifdef __linux__
+        if (::posix_fallocate(fd, 0, static_cast<off_t>(capacity)) == 0)
+            return 0;
+#endif // __linux__
+        return ::ftruncate(fd, static_cast<off_t>(capacity));
+    }
+
+public:
+    // records not consumed yet, and their bytes
+    std::size_t live = 0;
+    std::uint64_t live_bytes = 0;
+
+    log_segment(log_segment const&) = delete;
+    auto operator= (log_segment const&) -> log_segment& = delete;
+
+    ~log_segment()
+    {
+        if (map_ != nullptr)
+            ::munmap(map_, capacity_);
+        ::close(fd_);
+    }
+
+    static auto file_name(std::uint64_t id) -> std::string
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.log", static_cast<unsigned long long>(id));
+        return name;
+    }
+
+    // a new segment of capacity bytes in dir; nullptr on error
+    static auto create(std::filesystem::path const& dir, std::uint64_t id, std::size_t capacity) -> std::unique_ptr<log_segment>
+    {
+        std::filesystem::path const path = dir / file_name(id);
+        int const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log open " << path << ": " << std::strerror(errno);
+            return nullptr;
+        }
+        if (allocate(fd, capacity) != 0 or ::fsync(fd) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log allocate " << path << ": " << std::strerror(errno);
+            ::close(fd);
+            ::unlink(path.c_str());
+            return nullptr;
+        }
+        return map(id, path, fd, capacity);
+    }
+
+    // an existing segment, to be scanned; nullptr on error
+    static auto open(std::filesystem::path const& path, std::uint64_t id) -> std::unique_ptr<log_segment>
+    {
+        int const fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 or ::fstat(fd, &st) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log open " << path << ": " << std::strerror(errno);
+            if (fd != -1)
+                ::close(fd);
+            return nullptr;
+        }
+        return map(id, path, fd, static_cast<std::size_t>(st.st_size));
+    }
+
+    auto id() const -> std::uint64_t { return id_; }
+    auto path() const -> std::filesystem::path const& { return path_; }
+    auto capacity() const -> std::size_t { return capacity_; }
+    auto end() const -> std::size_t { return end_; }
+    auto at(std::size_t offset) const -> pack::unit_t const* { return map_ + offset; }
+
+    bool fits(std::size_t bytes) const { return end_ + bytes <= capacity_; }
+
+    // bytes at the end, to be filled before the next sync
+    auto extend(std::size_t bytes) -> pack::unit_t*
+    {
+        pack::unit_t* const pos = map_ + end_;
+        end_ += bytes;
+        return pos;
+    }
+
+    // a scanned segment ends after its last whole record
+    void recovered(std::size_t end) { end_ = synced_ = end; }
+
+    // writes the pages appended to since the last sync back to the file
+    bool sync()
+    {
+        if (synced_ == end_)
+            return true;
+        static std::size_t const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        std::size_t const from = synced_ / page * page;
+        if (::msync(map_ + from, end_ - from, MS_SYNC) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log msync " << path_ << ": " << std::strerror(errno);
+            return false;
+        }
+        synced_ = end_;
+        return true;
+    }
+
+    void remove()
+    {
+        std::error_code ec;
+        std::filesystem::remove(path_, ec);
+    }
+};
+
+// an append-only log of the messages put into buckets, so that they
+// survive a restart. puts and consumes are queued under a mutex and
+// return at once; one writer thread copies each batch into the mapped
+// segment files and syncs it, so a single msync commits every put that
+// came in meanwhile. a put acked by the proxy is on disk one commit
+// interval later. on start the segments are mapped and scanned, and the
+// messages no consume record cancels go back into their buckets in the
+// order they were put
+class durable_log
+{
+public:
+    struct settings
+    {
+        std::filesystem::path dir;
+        std::size_t segment_size = 64 << 20;
+        std::chrono::microseconds commit_interval {5000}; // wait this long for a batch to fill
+        std::size_t max_batch_bytes = 4 << 20;            // or until it has this many bytes
+    };
+
+    using restore_function = std::function<void (topic_key const&, std::uint64_t seq, pack::packet_data)>;
+
+private:
+    struct entry
+    {
+        std::uint64_t seq;
+        bool put;
+        topic_key key;          // of a put
+        pack::packet_data data; // of a put
+    };
+
+    struct location
+    {
+        log_segment* segment;
+        std::size_t offset;
+        std::size_t bytes;
+    };
+
+    settings const settings_;
+
+    // filled from any thread
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::vector<entry> pending_;
+    std::size_t pending_bytes_ = 0;
+    std::uint64_t next_seq_ = 1;
+    bool accepting_ = false;
+    bool stopping_ = false;
+
+    // only touched by the writer, or by recover() before it starts
+    std::deque<std::unique_ptr<log_segment>> segments_; // oldest first; appends go to back()
+    std::unordered_map<std::uint64_t, location> live_;   // every put not consumed, by seq
+    std::unordered_set<std::uint64_t> batch_puts_;
+    std::unordered_set<std::uint64_t> batch_skips_;
+    std::uint64_t next_segment_ = 0;
+    bool failed_ = false;
+    int lock_fd_ = -1;
+    std::thread writer_;
+
+    void track(std::uint64_t seq, location loc)
+    {
+        untrack(seq);
+        loc.segment->live++;
+        loc.segment->live_bytes += loc.bytes;
+        live_.emplace(seq, loc);
+    }
+
+    bool untrack(std::uint64_t seq)
+    {
+        auto it = live_.find(seq);
+        if (it == live_.end())
+            return false;
+        it->second.segment->live--;
+        it->second.segment->live_bytes -= it->second.bytes;
+        live_.erase(it);
+        return true;
+    }
+
+    // reads the records of a segment into live_ until the first one that
+    // is missing or torn; returns where that one starts
+    auto scan(log_segment& segment, std::uint64_t& max_seq) -> std::size_t
+    {
+        std::size_t offset = 0;
+        while (offset + sizeof(log_record) <= segment.capacity())
+        {
+            log_record r;
+            std::memcpy(&r, segment.at(offset), sizeof(r));
+            if (r.magic != log_record::magic_value)
+                break;
+
+            std::size_t const bytes = log_record::padded(r.size);
+            if (offset + bytes > segment.capacity() or r.checksum != r.compute_checksum(segment.at(offset + sizeof(r))))
+            {
+                BOOST_LOG_TRIVIAL(warning) << "durable_log " << segment.path() << " ends in a torn record at " << offset;
+                break;
+            }
+
+            max_seq = std::max(max_seq, r.seq);
+            if (r.type == log_record::kind::put)
+                track(r.seq, location{&segment, offset, bytes});
+            else
+                untrack(r.seq);
+            offset += bytes;
+        }
+        return offset;
+    }
+
+    bool open_segment(std::size_t capacity)
+    {
+        auto segment = log_segment::create(settings_.dir, next_segment_, (capacity + 7) / 8 * 8);
+        if (segment == nullptr)
+            return false;
+        next_segment_++;
+
+        // the new file name must survive a crash too
+        int const dir = ::open(settings_.dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir != -1)
+        {
+            ::fsync(dir);
+            ::close(dir);
+        }
+        segments_.push_back(std::move(segment));
+        return true;
+    }
+
+    // the segment bytes more go to, opening a new one once back() is full
+    auto room_for(std::size_t bytes) -> log_segment*
+    {
+        if (not segments_.back()->fits(bytes) and
+            not open_segment(std::max(settings_.segment_size, bytes)))
+            return nullptr;
+        return segments_.back().get();
+    }
+
+    // room for r and its body, which goes right after the header
+    auto reserve_record(log_record const& r) -> std::pair<location, pack::unit_t*>
+    {
+        std::size_t const bytes = log_record::padded(r.size);
+        log_segment* const segment = room_for(bytes);
+        if (segment == nullptr)
+            return {location{nullptr, 0, 0}, nullptr};
+
+        std::size_t const offset = segment->end();
+        return {location{segment, offset, bytes}, segment->extend(bytes)};
+    }
+
+    // the header goes last, over a body already in place
+    static void seal_record(log_record& r, pack::unit_t* pos)
+    {
+        r.magic = log_record::magic_value;
+        r.checksum = r.compute_checksum(pos + sizeof(r));
+        std::memcpy(pos, &r, sizeof(r));
+    }
+
+    auto write_record(log_record& r, pack::unit_t const* body) -> location
+    {
+        auto const [loc, pos] = reserve_record(r);
+        if (pos == nullptr)
+            return loc;
+        if (r.size != 0)
+            std::memcpy(pos + sizeof(r), body, r.size);
+        seal_record(r, pos);
+        return loc;
+    }
+
+    // a record without a body, as a consume
+    auto write_record(log_record& r) -> location
+    {
+        r.size = 0;
+        auto const [loc, pos] = reserve_record(r);
+        if (pos != nullptr)
+            seal_record(r, pos);
+        return loc;
+    }
+
+    // a put consumed within the same batch never reaches the disk
+    bool write(std::vector<entry> const& batch)
+    {
+        batch_puts_.clear();
+        batch_skips_.clear();
+        for (entry const& e : batch)
+            if (e.put)
+                batch_puts_.insert(e.seq);
+            else if (batch_puts_.contains(e.seq))
+                batch_skips_.insert(e.seq);
+
+        for (entry const& e : batch)
+        {
+            if (batch_skips_.contains(e.seq))
+                continue;
+
+            log_record r{};
+            r.seq = e.seq;
+            if (e.put)
+            {
+                r.type = log_record::kind::put;
+                r.size = static_cast<std::uint32_t>(e.data.buf.size());
+                r.salt = e.key.salt;
+                r.key = e.key.key;
+                r.compressed = e.data.compressed;
+                location const loc = write_record(r, e.data.buf.data());
+                if (loc.segment == nullptr)
+                    return false;
+                track(e.seq, loc);
+            }
+            else if (untrack(e.seq))
+            {
+                r.type = log_record::kind::consume;
+                if (write_record(r).segment == nullptr)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool commit()
+    {
+        for (auto& segment : segments_)
+            if (not segment->sync())
+                return false;
+        return true;
+    }
+
+    // only the oldest segment is ever dropped: a consume record refers to
+    // a put in its own segment or an older one, so dropping from the
+    // front never loses a consume whose put is still on disk. the oldest
+    // goes once nothing in it is live; while less than half of it is, or
+    // the log takes more than twice the live bytes, its live puts are
+    // first copied to the newest segment, keeping their seq
+    bool compact()
+    {
+        std::size_t dropped = 0, moved = 0;
+        while (segments_.size() > 1)
+        {
+            log_segment& oldest = *segments_.front();
+            if (oldest.live != 0)
+            {
+                std::uint64_t disk = 0, live = 0;
+                for (auto const& segment : segments_)
+                {
+                    disk += segment->end();
+                    live += segment->live_bytes;
+                }
+                bool const sparse = oldest.live_bytes * 2 <= oldest.end();
+                bool const bloated = disk > 2 * live + 2 * settings_.segment_size;
+                if (not sparse and not bloated)
+                    break;
+
+                for (std::size_t offset = 0; offset < oldest.end(); )
+                {
+                    log_record r;
+                    std::memcpy(&r, oldest.at(offset), sizeof(r));
+                    std::size_t const bytes = log_record::padded(r.size);
+                    auto it = live_.find(r.seq);
+                    if (r.type == log_record::kind::put and it != live_.end() and
+                        it->second.segment == &oldest and it->second.offset == offset)
+                    {
+                        log_segment* const segment = room_for(bytes);
+                        if (segment == nullptr)
+                            return false;
+                        std::size_t const to = segment->end();
+                        std::memcpy(segment->extend(bytes), oldest.at(offset), bytes);
+                        track(r.seq, location{segment, to, bytes});
+                        moved++;
+                    }
+                    offset += bytes;
+                }
+                if (not commit())
+                    return false;
+            }
+
+            oldest.remove();
+            segments_.pop_front();
+            dropped++;
+        }
+
+        if (dropped != 0)
+            BOOST_LOG_TRIVIAL(info) << "durable_log dropped " << dropped << " segments, moved " << moved
+                                    << " live records; " << segments_.size() << " segments, " << live_.size() << " live records left";
+        return true;
+    }
+
+    // stops logging for good after a disk error; buckets keep working from memory
+    void fail()
+    {
+        BOOST_LOG_TRIVIAL(error) << "durable_log failed, messages put from now on are not kept on disk";
+        failed_ = true;
+        std::scoped_lock lock{mutex_};
+        accepting_ = false;
+    }
+
+    void run()
+    {
+        if (not compact())
+            fail();
+
+        std::vector<entry> batch;
+        for (;;)
+        {
+            {
+                std::unique_lock lock{mutex_};
+                pending_cv_.wait(lock, [this] { return not pending_.empty() or stopping_; });
+                // group commit: let more appends join this batch before paying for the sync
+                if (settings_.commit_interval.count() != 0)
+                    pending_cv_.wait_for(lock, settings_.commit_interval, [this] {
+                        return pending_bytes_ >= settings_.max_batch_bytes or stopping_;
+                    });
+                if (pending_.empty() and stopping_)
+                    break;
+                batch.swap(pending_);
+                pending_bytes_ = 0;
+            }
+
+            if (not failed_ and not (write(batch) and commit() and compact()))
+                fail();
+            batch.clear();
+        }
+    }
+
+    // a put gets the next seq here, so puts are queued in seq order
+    auto enqueue(entry e, std::size_t bytes) -> std::uint64_t
+    {
+        bool wake = false;
+        std::uint64_t seq = 0;
+        {
+            std::scoped_lock lock{mutex_};
+            if (not accepting_)
+                return 0;
+            if (e.put)
+                e.seq = next_seq_++;
+            seq = e.seq;
+            wake = pending_.empty() or
+                   (pending_bytes_ < settings_.max_batch_bytes and pending_bytes_ + bytes >= settings_.max_batch_bytes);
+            pending_.push_back(std::move(e));
+            pending_bytes_ += bytes;
+        }
+        if (wake)
+            pending_cv_.notify_one();
+        return seq;
+    }
+
+public:
+    explicit durable_log(settings s): settings_{std::move(s)} {}
+    ~durable_log()
+    {
+        stop();
+        if (lock_fd_ != -1)
+            ::close(lock_fd_);
+    }
+
+    // scans the segments in settings.dir and hands every live message to
+    // restore, oldest first. false if the directory can not be used
+    bool recover(restore_function const& restore)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(settings_.dir, ec);
+        if (ec)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log " << settings_.dir << ": " << ec.message();
+            return false;
+        }
+
+        // one proxy per directory
+        std::filesystem::path const lock = settings_.dir / "lock";
+        lock_fd_ = ::open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd_ == -1 or ::flock(lock_fd_, LOCK_EX | LOCK_NB) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "durable_log lock " << lock << ": " << std::strerror(errno);
+            return false;
+        }
+
+        std::vector<std::pair<std::uint64_t, std::filesystem::path>> files;
+        for (auto const& file : std::filesystem::directory_iterator{settings_.dir, ec})
+        {
+            std::string const name = file.path().filename().string();
+            std::uint64_t id = 0;
+            if (file.path().extension() == ".log" and name.size() == 20 and
+                std::from_chars(name.data(), name.data() + 16, id, 16).ec == std::errc{})
+                files.emplace_back(id, file.path());
+        }
+        std::sort(files.begin(), files.end());
+
+        std::uint64_t max_seq = 0;
+        for (auto const& [id, path] : files)
+        {
+            auto segment = log_segment::open(path, id);
+            if (segment == nullptr)
+                return false;
+            segment->recovered(scan(*segment, max_seq));
+            next_segment_ = id + 1;
+            segments_.push_back(std::move(segment));
+        }
+
+        std::vector<std::pair<std::uint64_t, location>> order(live_.begin(), live_.end());
+        std::sort(order.begin(), order.end(),
+                  [] (auto const& a, auto const& b) { return a.first < b.first; });
+        std::uint64_t bytes = 0;
+        for (auto const& [seq, loc] : order)
+        {
+            log_record r;
+            std::memcpy(&r, loc.segment->at(loc.offset), sizeof(r));
+            pack::packet_data data;
+            if (r.size != 0)
+                std::memcpy(data.allocate(r.size), loc.segment->at(loc.offset + sizeof(r)), r.size);
+            data.compressed = r.compressed;
+
+            topic_key k;
+            k.key = r.key;
+            k.salt = r.salt;
+            restore(k, seq, std::move(data));
+            bytes += r.size;
+        }
+        next_seq_ = max_seq + 1;
+        BOOST_LOG_TRIVIAL(info) << "durable_log recovered " << order.size() << " messages (" << bytes << " bytes) from "
+                                << segments_.size() << " segments in " << settings_.dir;
+
+        // recovered segments are only read from now on; appends go to a new one
+        return open_segment(settings_.segment_size);
+    }
+
+    void start()
+    {
+        std::scoped_lock lock{mutex_};
+        accepting_ = true;
+        writer_ = std::thread{[this] { run(); }};
+    }
+
+    // commits what is queued and stops the writer. puts and consumes
+    // after this are not logged
+    void stop()
+    {
+        {
+            std::scoped_lock lock{mutex_};
+            accepting_ = false;
+            stopping_ = true;
+        }
+        pending_cv_.notify_all();
+        if (writer_.joinable())
+            writer_.join();
+    }
+
+    // queues a put of data to the bucket k; its seq, or 0 if it is not logged
+    auto append(topic_key const& k, pack::packet_data const& data) -> std::uint64_t
+    {
+        return enqueue(entry{0, true, k, data}, log_record::padded(data.buf.size()));
+    }
+
+    // queues a consume of the put with seq
+    void consume(std::uint64_t seq)
+    {
+        enqueue(entry{seq, false, topic_key{}, pack::packet_data{}}, sizeof(log_record));
+    }
+};
+
+} // namespace basic
+
+#endif // DURABLE_LOG_HPP__
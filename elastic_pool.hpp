@@ -0,0 +1,269 @@
+#pragma once
+#ifndef ELASTIC_POOL_HPP__
+#define ELASTIC_POOL_HPP__
+
+#include "basic.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace basic
+{
+
+// the threads running one io_context, between min_threads and
+// max_threads of them. every interval a probe is posted to the
+// io_context: the time it waits to run is the queue delay. together with
+// the cpu time the process used per running thread it decides whether a
+// thread is added or parked. a thread parks inside a posted handler, so
+// the hot path never checks anything; it runs on again when woken.
+// the calling thread counts as thread 0 and runs run_thread(0) itself.
+class elastic_pool
+{
+public:
+    struct settings
+    {
+        std::size_t min_threads = 1;
+        std::size_t max_threads = 1;
+        std::chrono::milliseconds interval {100};
+        std::chrono::microseconds target_delay {500};
+        bool measure_utilization = true; // off when threads spin, they always look busy
+        std::size_t idle_ticks_to_park = 10;
+    };
+
+    struct stats
+    {
+        std::size_t running = 0;
+        std::size_t parked = 0;
+        std::uint64_t added = 0;
+        std::uint64_t parks = 0;
+        std::chrono::microseconds queue_delay {0};
+        double utilization = 0;
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    net::io_context& io_;
+    settings const settings_;
+    std::function<void (std::size_t)> run_thread_;
+    net::steady_timer timer_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_up_;
+    std::vector<std::thread> threads_; // all but thread 0
+    std::size_t running_ = 1;
+    std::size_t pending_parks_ = 0;   // posted, not yet run
+    std::size_t cancelled_parks_ = 0; // posted, then undone by a grow
+    std::size_t wakeups_ = 0;
+    bool stopping_ = false;
+    stats stats_;
+
+    // controller state, only touched by the probe chain
+    std::size_t idle_ticks_ = 0;
+    clock::time_point last_tick_ = clock::now();
+    std::chrono::microseconds last_cpu_ = cpu_time();
+
+    static auto cpu_time() -> std::chrono::microseconds
+    {
+        rusage usage;
+        if (::getrusage(RUSAGE_SELF, &usage) != 0)
+            return std::chrono::microseconds{0};
+        auto us = [] (timeval const& t) { return std::chrono::seconds{t.tv_sec} + std::chrono::microseconds{t.tv_usec}; };
+        return us(usage.ru_utime) + us(usage.ru_stime);
+    }
+
+    // mutex_ must be held
+    void grow()
+    {
+        running_++;
+        stats_.added++;
+        if (pending_parks_ != 0)
+        {
+            pending_parks_--;
+            cancelled_parks_++;
+        }
+        else if (stats_.parked != wakeups_)
+        {
+            wakeups_++;
+            wake_up_.notify_one();
+        }
+        else
+        {
+            std::size_t const i = threads_.size() + 1;
+            threads_.emplace_back([this, i] { run_thread_(i); });
+        }
+    }
+
+    // mutex_ must be held
+    void shrink()
+    {
+        running_--;
+        pending_parks_++;
+        stats_.parks++;
+        net::post(io_, [this] { park(); });
+    }
+
+    void park()
+    {
+        std::unique_lock lock{mutex_};
+        if (cancelled_parks_ != 0)
+        {
+            cancelled_parks_--;
+            return;
+        }
+        pending_parks_--;
+        stats_.parked++;
+        wake_up_.wait(lock, [this] { return wakeups_ != 0 or stopping_; });
+        if (wakeups_ != 0)
+            wakeups_--;
+        stats_.parked--;
+    }
+
+    void decide(std::chrono::microseconds delay)
+    {
+        clock::time_point const now = clock::now();
+        std::chrono::microseconds const cpu = cpu_time();
+        auto const wall = std::chrono::duration_cast<std::chrono::microseconds>(now - last_tick_);
+
+        std::scoped_lock lock{mutex_};
+        if (stopping_)
+            return;
+
+        double const utilization = (wall.count() == 0)? 0:
+            static_cast<double>((cpu - last_cpu_).count()) / (static_cast<double>(wall.count()) * running_);
+        last_tick_ = now;
+        last_cpu_ = cpu;
+        stats_.queue_delay = delay;
+        stats_.utilization = utilization;
+
+        bool const use_util = settings_.measure_utilization;
+        bool const busy = delay > settings_.target_delay or (use_util and utilization > 0.85);
+        bool const idle = delay < settings_.target_delay / 4 and (not use_util or utilization < 0.25);
+
+        char const* decision = nullptr;
+        if (busy and running_ < settings_.max_threads)
+        {
+            grow();
+            decision = "add";
+        }
+        if (idle and running_ > settings_.min_threads and ++idle_ticks_ >= settings_.idle_ticks_to_park)
+        {
+            shrink();
+            decision = "park";
+        }
+        if (not idle or decision)
+            idle_ticks_ = 0;
+
+        stats_.running = running_;
+        if (decision)
+            BOOST_LOG_TRIVIAL(info) << "elastic_pool " << decision << ": running=" << running_
+                                    << " parked=" << stats_.parked - wakeups_ + pending_parks_
+                                    << " queue_delay=" << delay.count() << "us"
+                                    << " utilization=" << static_cast<int>(utilization * 100) << "%";
+    }
+
+    void start_tick()
+    {
+        timer_.expires_after(settings_.interval);
+        timer_.async_wait(
+            [this] (boost::system::error_code ec) {
+                if (ec)
+                    return;
+                clock::time_point const posted = clock::now();
+                net::post(io_, [this, posted] {
+                    decide(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - posted));
+                    start_tick();
+                });
+            });
+    }
+
+public:
+    elastic_pool(net::io_context& io, settings s, std::function<void (std::size_t)> run_thread):
+        io_{io}, settings_{s}, run_thread_{std::move(run_thread)}, timer_{io}
+    {
+        threads_.reserve(settings_.max_threads);
+    }
+
+    // starts min_threads - 1 threads and the controller; the caller runs thread 0
+    void start()
+    {
+        std::scoped_lock lock{mutex_};
+        for (std::size_t i = 1; i < settings_.min_threads; i++)
+            threads_.emplace_back([this, i] { run_thread_(i); });
+        running_ = settings_.min_threads;
+        stats_.running = running_;
+        start_tick();
+    }
+
+    // wakes parked threads for good; the io_context is stopped separately
+    void stop()
+    {
+        std::scoped_lock lock{mutex_};
+        stopping_ = true;
+        wake_up_.notify_all();
+        net::post(io_, [this] { timer_.cancel(); });
+    }
+
+    void join()
+    {
+        std::vector<std::thread> threads;
+        {
+            std::scoped_lock lock{mutex_};
+            stopping_ = true; // no thread is added from here on
+            wake_up_.notify_all();
+            threads.swap(threads_);
+        }
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    auto current() -> stats
+    {
+        std::scoped_lock lock{mutex_};
+        return stats_;
+    }
+};
+
+// logs the stats of a pool every interval: the metrics of --max-threads
+class elastic_pool_reporter : public std::enable_shared_from_this<elastic_pool_reporter>
+{
+    net::steady_timer timer_;
+    elastic_pool& pool_;
+    std::chrono::seconds const interval_;
+
+public:
+    elastic_pool_reporter(net::io_context& io, elastic_pool& pool, std::chrono::seconds interval):
+        timer_{io}, pool_{pool}, interval_{interval} {}
+
+    void report()
+    {
+        elastic_pool::stats const s = pool_.current();
+        BOOST_LOG_TRIVIAL(info) << "elastic_pool stats: running=" << s.running << " parked=" << s.parked
+                                << " added=" << s.added << " parks=" << s.parks
+                                << " queue_delay=" << s.queue_delay.count() << "us"
+                                << " utilization=" << static_cast<int>(s.utilization * 100) << "%";
+    }
+
+    void start_report()
+    {
+        timer_.expires_after(interval_);
+        timer_.async_wait(
+            [self=shared_from_this()] (boost::system::error_code ec) {
+                if (ec)
+                    return;
+                self->report();
+                self->start_report();
+            });
+    }
+};
+
+} // namespace basic
+
+#endif // ELASTIC_POOL_HPP__
@@ -0,0 +1,200 @@
+#pragma once
+#ifndef FLOW_CONTROL_HPP__
+#define FLOW_CONTROL_HPP__
+
+#include "handler_memory.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace basic
+{
+
+struct limits
+{
+    std::uint64_t high = 0; // 0 = unlimited
+    std::uint64_t low = 0;
+};
+
+// byte count with hysteresis: blocked from reaching high until it drains
+// to low. add/sub are lock free; the mutex is only taken on a crossing
+// and by readers registering to be woken when it drains.
+class watermark
+{
+    std::atomic<std::uint64_t> bytes_ = 0;
+    std::atomic<bool> blocked_ = false;
+    limits const limits_;
+    std::mutex mutex_;
+    std::vector<callback<void ()>> waiters_;
+
+public:
+    watermark(limits l): limits_{l} {}
+
+    bool enabled() const { return limits_.high != 0; }
+    bool blocked() const { return blocked_.load(); }
+    auto bytes() const -> std::uint64_t { return bytes_.load(); }
+
+    void add(std::uint64_t n)
+    {
+        if (bytes_.fetch_add(n) + n < limits_.high or not enabled() or blocked_.load())
+            return;
+
+        std::scoped_lock lock{mutex_};
+        if (blocked_.load() or bytes_.load() < limits_.high)
+            return;
+        blocked_.store(true);
+
+        // a sub() that saw blocked_ == false is already counted here
+        if (bytes_.load() <= limits_.low)
+            blocked_.store(false);
+    }
+
+    void sub(std::uint64_t n)
+    {
+        if (bytes_.fetch_sub(n) - n > limits_.low or not blocked_.load())
+            return;
+
+        std::vector<callback<void ()>> wake;
+        {
+            std::scoped_lock lock{mutex_};
+            if (not blocked_.load() or bytes_.load() > limits_.low)
+                return;
+            blocked_.store(false);
+            std::swap(wake, waiters_);
+        }
+        for (callback<void ()>& w : wake)
+            w();
+    }
+
+    // true if blocked; on_drained then runs once, when it drains to low
+    template<typename Function>
+    bool wait_if_blocked(Function && on_drained)
+    {
+        if (not blocked_.load())
+            return false;
+
+        std::scoped_lock lock{mutex_};
+        if (not blocked_.load())
+            return false;
+        waiters_.emplace_back(std::forward<Function>(on_drained));
+        return true;
+    }
+};
+
+// bytes held on behalf of one connection, counted against its own
+// watermark and the process-wide one until the charge is destroyed
+class charge
+{
+    std::shared_ptr<watermark> local_;
+    watermark* global_ = nullptr;
+    std::uint64_t bytes_ = 0;
+
+    void release()
+    {
+        if (local_)
+            local_->sub(bytes_);
+        if (global_)
+            global_->sub(bytes_);
+    }
+
+public:
+    charge() = default;
+
+    charge(std::shared_ptr<watermark> local, watermark* global, std::uint64_t bytes):
+        local_{std::move(local)}, global_{global}, bytes_{bytes}
+    {
+        if (local_)
+            local_->add(bytes_);
+        if (global_)
+            global_->add(bytes_);
+    }
+
+    charge(charge && other) noexcept:
+        local_{std::move(other.local_)},
+        global_{std::exchange(other.global_, nullptr)},
+        bytes_{std::exchange(other.bytes_, 0)} {}
+
+    auto operator= (charge && other) noexcept -> charge&
+    {
+        if (this != &other)
+        {
+            release();
+            local_  = std::move(other.local_);
+            global_ = std::exchange(other.global_, nullptr);
+            bytes_  = std::exchange(other.bytes_, 0);
+        }
+        return *this;
+    }
+
+    ~charge() { release(); }
+};
+
+// process-wide watermarks, shared by every connection
+struct global_flow
+{
+    watermark inbound;
+    watermark outbound;
+
+    global_flow(limits in, limits out): inbound{in}, outbound{out} {}
+};
+
+struct flow_limits
+{
+    limits inbound;  // bytes a connection has queued in buckets
+    limits outbound; // bytes a connection has not yet sent
+    std::uint64_t stream_window = 8 << 20; // bytes of a streamed body read ahead of the worker
+};
+
+// watermarks of one connection. inbound counts bodies it put into
+// bucket queues until they are taken out; outbound counts replies it has
+// not sent yet. reading stops while its own watermark is blocked, or the
+// global one is and the connection holds bytes of that kind: readers
+// that only consume keep going, so queues can drain.
+class flow_control
+{
+    std::shared_ptr<watermark> inbound_;
+    std::shared_ptr<watermark> outbound_;
+    global_flow* global_;
+
+    // the local count is kept whenever either limit is on:
+    // wait_if_blocked() needs it to tell who holds bytes
+    static auto make_charge(std::shared_ptr<watermark> const& local, watermark& global, std::uint64_t bytes) -> charge
+    {
+        if (not local->enabled() and not global.enabled())
+            return {};
+        return charge{local, global.enabled()? &global: nullptr, bytes};
+    }
+
+public:
+    flow_control(flow_limits const& l, global_flow& g):
+        inbound_{std::make_shared<watermark>(l.inbound)},
+        outbound_{std::make_shared<watermark>(l.outbound)},
+        global_{&g} {}
+
+    auto charge_inbound(std::uint64_t bytes) -> charge { return make_charge(inbound_, global_->inbound, bytes); }
+    auto charge_outbound(std::uint64_t bytes) -> charge { return make_charge(outbound_, global_->outbound, bytes); }
+
+    // true if reading has to stop; on_drained(), made by make_waiter(),
+    // then runs once the watermark that blocked drains
+    template<typename MakeWaiter>
+    bool wait_if_blocked(MakeWaiter && make_waiter)
+    {
+        watermark* const marks[] = {
+            inbound_.get(),
+            outbound_.get(),
+            inbound_->bytes() != 0?  &global_->inbound:  nullptr,
+            outbound_->bytes() != 0? &global_->outbound: nullptr,
+        };
+
+        for (watermark* w : marks)
+            if (w != nullptr and w->blocked() and w->wait_if_blocked(make_waiter()))
+                return true;
+        return false;
+    }
+};
+
+} // namespace basic
+
+#endif // FLOW_CONTROL_HPP__
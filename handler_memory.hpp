@@ -0,0 +1,120 @@
+#pragma once
+#ifndef HANDLER_MEMORY_HPP__
+#define HANDLER_MEMORY_HPP__
+
+#include "buffer_pool.hpp"
+
+#include <type_traits>
+#include <utility>
+
+namespace basic
+{
+
+// completion handler whose operation storage comes from
+// pack::recycling_allocator, through asio's associated allocator.
+// only wrap plain lambdas: an associated executor is not forwarded
+template<typename Handler>
+class recycled_handler
+{
+    Handler handler_;
+
+public:
+    using allocator_type = pack::recycling_allocator<void>;
+
+    template<typename H>
+    explicit recycled_handler(H && h): handler_{std::forward<H>(h)} {}
+
+    auto get_allocator() const noexcept -> allocator_type { return {}; }
+
+    template<typename ... Args>
+    void operator() (Args && ... args) { handler_(std::forward<Args>(args)...); }
+};
+
+template<typename Handler>
+auto recycled(Handler && h) { return recycled_handler<std::decay_t<Handler>>{std::forward<Handler>(h)}; }
+
+template<typename Signature>
+class callback;
+
+// move-only std::function; the callable lives in a recycled block, so
+// storing a reply or listener allocates nothing once the lists are warm
+template<typename R, typename ... Args>
+class callback<R (Args...)>
+{
+    struct base
+    {
+        virtual auto call(Args ... args) -> R = 0;
+        virtual void destroy() noexcept = 0;
+    protected:
+        ~base() = default;
+    };
+
+    template<typename F>
+    struct impl final : base
+    {
+        F f;
+
+        template<typename G>
+        impl(G && g): f{std::forward<G>(g)} {}
+
+        auto call(Args ... args) -> R override { return f(std::forward<Args>(args)...); }
+
+        void destroy() noexcept override
+        {
+            pack::recycling_allocator<impl> alloc;
+            this->~impl();
+            alloc.deallocate(this, 1);
+        }
+    };
+
+    base* impl_ = nullptr;
+
+public:
+    callback() = default;
+
+    template<typename F>
+        requires (not std::is_same_v<std::decay_t<F>, callback>)
+    callback(F && f)
+    {
+        using impl_type = impl<std::decay_t<F>>;
+        pack::recycling_allocator<impl_type> alloc;
+        impl_type* p = alloc.allocate(1);
+        try
+        {
+            impl_ = ::new (static_cast<void*>(p)) impl_type{std::forward<F>(f)};
+        }
+        catch (...)
+        {
+            alloc.deallocate(p, 1);
+            throw;
+        }
+    }
+
+    callback(callback && other) noexcept: impl_{std::exchange(other.impl_, nullptr)} {}
+
+    auto operator= (callback && other) noexcept -> callback&
+    {
+        if (this != &other)
+        {
+            reset();
+            impl_ = std::exchange(other.impl_, nullptr);
+        }
+        return *this;
+    }
+
+    ~callback() { reset(); }
+
+    void reset() noexcept
+    {
+        if (impl_ != nullptr)
+            std::exchange(impl_, nullptr)->destroy();
+    }
+
+    explicit operator bool() const noexcept { return impl_ != nullptr; }
+
+    auto operator() (Args ... args) const -> R { return impl_->call(std::forward<Args>(args)...); }
+};
+
+} // namespace basic
+
+#endif // HANDLER_MEMORY_HPP__
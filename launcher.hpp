@@ -4,17 +4,113 @@
 
 #include "basic.hpp"
 #include "serializer.hpp"
+#include "stream.hpp"
 #include "worker.hpp"
+#include "handler_memory.hpp"
 
 #include <oneapi/tbb/concurrent_unordered_set.h>
 #include <oneapi/tbb/concurrent_queue.h>
-#include <boost/signals2.hpp>
 
 #include <atomic>
+#include <mutex>
+#include <vector>
 
 namespace launcher
 {
 
+// where the body of a streamed trigger goes. chunks are written to the
+// worker as they come in; those that come before a worker is chosen wait
+// here, still counted against the sender's window. a worker that does
+// not take streams gets the body assembled into one worker_push_request
+class body_stream
+{
+    std::mutex mutex_;
+    pack::packet_header const header_; // of the job; every chunk carries it
+    std::shared_ptr<df::worker> worker_;
+    std::vector<pack::packet_pointer> held_;
+    basic::stream_assembler assembler_;
+    bool aborted_ = false;
+
+    // mutex_ must be held. a streaming worker is told the rest will not
+    // come; one that waits for the assembled body just never gets it
+    void send_abort()
+    {
+        if (not worker_->takes_streams())
+            return;
+        pack::packet_pointer err = pack::make_packet();
+        err->header = header_;
+        err->header.type = pack::msg_t::err;
+        worker_->start_write(err);
+    }
+
+    // mutex_ must be held
+    void write(pack::packet_pointer chunk)
+    {
+        if (worker_->takes_streams())
+        {
+            worker_->start_write(chunk);
+            return;
+        }
+
+        assembler_.add(*chunk);
+        if (pack::packet_pointer whole = assembler_.take_if_complete())
+            worker_->start_post(whole);
+    }
+
+public:
+    body_stream(pack::packet_header const& h): header_{h} {}
+
+    void forward(pack::packet_pointer chunk)
+    {
+        chunk->header = header_;
+        chunk->header.type = pack::msg_t::chunk;
+
+        std::scoped_lock lock{mutex_};
+        if (aborted_)
+            return;
+        if (worker_)
+            write(chunk);
+        else
+            held_.push_back(chunk);
+    }
+
+    // begin is the msg_t::stream packet of the job. false if w does not
+    // take streams and the body is too large to assemble for it
+    bool attach(std::shared_ptr<df::worker> w, pack::packet_pointer begin)
+    {
+        std::scoped_lock lock{mutex_};
+        worker_ = w;
+        if (w->takes_streams())
+            w->start_write(begin);
+        else
+        {
+            pack::stream_header s;
+            s.parse(begin->data.buf);
+            if (not assembler_.start(header_, s))
+                return false;
+            if (pack::packet_pointer whole = assembler_.take_if_complete())
+                w->start_post(whole);
+        }
+
+        for (pack::packet_pointer& chunk : held_)
+            write(chunk);
+        held_.clear();
+        if (aborted_)
+            send_abort();
+        return true;
+    }
+
+    // the sender went away before the last chunk, or the job failed
+    void abort()
+    {
+        std::scoped_lock lock{mutex_};
+        aborted_ = true;
+        held_.clear();
+        if (worker_)
+            send_abort();
+    }
+};
+
 class job
 {
 public:
@@ -22,19 +118,22 @@ public:
     {
         registered,
         started,
-        finished
+        finished,
+        failed // by the proxy; whatever the worker sends later is dropped
     };
     state state_ = state::registered;
 
-    using on_completion_callable = boost::signals2::signal<void (pack::packet_pointer)>;
+    using on_completion_callable = basic::callback<void (pack::packet_pointer)>;
     on_completion_callable on_completion_;
     pack::packet_pointer pack_;
+    std::shared_ptr<body_stream> stream_; // set if pack_ is a msg_t::stream
+    std::shared_ptr<basic::spliced_body> splice_; // set if the body of pack_ is spliced in
 
     boost::asio::steady_timer timer_;
 
     template<typename Next>
     job (net::io_context& ioc, pack::packet_pointer p, Next && next):
-        pack_{p}, timer_{ioc} { on_completion_.connect(next); }
+        on_completion_{std::forward<Next>(next)}, pack_{p}, timer_{ioc} {}
 };
 
 using job_ptr = std::shared_ptr<job>;
@@ -53,14 +152,31 @@ class launcher
             pack::packet_header_key_compare>;
     jobmap started_jobs_;
     net::io_context::strand started_jobs_strand_, job_launch_strand_;
+    std::size_t const memfd_min_size_; // 0 = never pass bodies as memfd
+    std::uint64_t const stream_window_;  // bytes of streamed responses read ahead per worker
+    std::uint64_t const splice_min_size_; // 0 = never splice trigger bodies
 
 public:
-    launcher(net::io_context& io): io_context_{io}, started_jobs_strand_{io}, job_launch_strand_{io} { }
+    launcher(net::io_context& io, std::size_t memfd_min_size = 0, std::uint64_t stream_window = 8 << 20,
+             std::uint64_t splice_min_size = 0):
+        io_context_{io}, started_jobs_strand_{io}, job_launch_strand_{io},
+        memfd_min_size_{memfd_min_size}, stream_window_{stream_window}, splice_min_size_{splice_min_size} { }
+
+    // true if a trigger body of size bytes is spliced to its worker
+    bool splices(std::uint64_t size) const
+    {
+        return basic::spliced_body::supported() and splice_min_size_ != 0 and size >= splice_min_size_;
+    }
 
-    void add_worker(tcp::socket socket, pack::packet_pointer /*request*/)
+    // reader holds whatever the worker sent right after worker_reg
+    void add_worker(basic::stream_socket socket, pack::packet_pointer request, basic::read_buffer reader)
     {
-        auto && [it, ok] = workers_.emplace(std::make_shared<df::worker>(io_context_, std::move(socket), *this));
-        (*it)->start_read_header();
+        auto && [it, ok] = workers_.emplace(
+            std::make_shared<df::worker>(io_context_, std::move(socket), std::move(reader),
+                                         *this, *request, memfd_min_size_, stream_window_));
+        if (request->header.in_memfd())
+            (*it)->negotiate_memfd(request);
+        (*it)->start_read();
         start_jobs();
     }
 
@@ -77,12 +193,15 @@ public:
         net::post(
             net::bind_executor(
                 started_jobs_strand_,
-                [this, pack] () {
+                basic::recycled([this, pack] () {
                     job_ptr j = started_jobs_[pack->header];
+                    if (j->state_ == job::state::failed)
+                        return;
                     j->on_completion_(pack);
+                    if (j->state_ != job::state::finished)
+                        BOOST_LOG_TRIVIAL(info) << "job " << j->pack_->header << " complete";
                     j->state_ = job::state::finished;
-                    BOOST_LOG_TRIVIAL(info) << "job " << j->pack_->header << " complete";
-                }));
+                })));
     }
 
     void on_worker_ack(pack::packet_pointer pack)
@@ -90,12 +209,14 @@ public:
         net::post(
             net::bind_executor(
                 started_jobs_strand_,
-                [this, pack] () {
+                basic::recycled([this, pack] () {
                     job_ptr j = started_jobs_[pack->header];
+                    if (j->state_ == job::state::failed)
+                        return;
                     j->state_ = job::state::started;
                     BOOST_LOG_TRIVIAL(debug) << "job " << j->pack_->header << " get ack";
                     j->timer_.cancel();
-                }));
+                })));
     }
 
     void start_jobs()
@@ -116,22 +237,63 @@ public:
 
             BOOST_LOG_TRIVIAL(trace) << "Starting jobs, Start post. ";
 
-            worker_ptr->start_post(j->pack_);
+            if (j->splice_)
+                worker_ptr->start_splice(j->pack_, j->splice_);
+            else if (not j->stream_)
+                worker_ptr->start_post(j->pack_);
+            else if (not j->stream_->attach(worker_ptr, j->pack_))
+            {
+                BOOST_LOG_TRIVIAL(error) << "job " << j->pack_->header << " is too large for a worker without streams";
+                pack::packet_pointer err = pack::make_packet();
+                err->header = j->pack_->header;
+                err->header.type = pack::msg_t::err;
+                on_worker_response(err);
+                continue;
+            }
 
             using namespace std::chrono_literals;
             j->timer_.async_wait(
-                [this, j] (boost::system::error_code ec) {
+                basic::recycled([this, j] (boost::system::error_code ec) {
                     if (ec && ec != boost::asio::error::operation_aborted)
                     {
                         BOOST_LOG_TRIVIAL(debug) << "error: " << ec << "repush job " << j->pack_->header;
-                        registered_jobs_.push(j);
+                        repush_job(j);
                     }
-                });
+                }));
             BOOST_LOG_TRIVIAL(info) << "start job " << j->pack_->header;
             j->timer_.expires_from_now(1s);
         }
     }
 
+    // a job goes back to the queue to be posted again, unless its body
+    // was spliced or streamed to the worker: that body is consumed, so
+    // the job fails with err instead
+    void repush_job(job_ptr j)
+    {
+        if (not j->splice_ and not j->stream_)
+        {
+            registered_jobs_.push(j);
+            return;
+        }
+
+        BOOST_LOG_TRIVIAL(error) << "job " << j->pack_->header << " can not be posted again, its body is consumed";
+        if (j->stream_)
+            j->stream_->abort();
+
+        net::post(
+            net::bind_executor(
+                started_jobs_strand_,
+                basic::recycled([j] () {
+                    if (j->state_ == job::state::finished or j->state_ == job::state::failed)
+                        return;
+                    pack::packet_pointer err = pack::make_packet();
+                    err->header = j->pack_->header;
+                    err->header.type = pack::msg_t::err;
+                    j->on_completion_(err);
+                    j->state_ = job::state::failed;
+                })));
+    }
+
     void create_worker(std::string const& body)
     {
         static std::string const url = "https://ow-ctrl/api/v1/namespaces/_/actions/slsfs-datafunction?blocking=false&result=false";
@@ -148,16 +310,15 @@ public:
     }
 
     template<typename Callback>
-    void start_trigger_post(std::string const& body, Callback next)
+    void start_trigger_post(pack::packet_data&& body, Callback next)
     {
-        pack::packet_pointer pack = std::make_shared<pack::packet>();
+        pack::packet_pointer pack = pack::make_packet();
 
         pack->header.gen();
         pack->header.type = pack::msg_t::worker_push_request;
-        pack->data.buf = std::vector<pack::unit_t>(body.size());
-        std::memcpy(pack->data.buf.data(), body.data(), body.size());
+        pack->data = std::move(body);
 
-        auto j = std::make_shared<job>(io_context_, pack, next);
+        auto j = std::allocate_shared<job>(pack::recycling_allocator<job>{}, io_context_, pack, std::move(next));
         registered_jobs_.push(j);
         started_jobs_.emplace(pack->header, j);
         start_jobs();
@@ -170,6 +331,42 @@ public:
 //                [next](std::shared_ptr<http::response<http::string_body>> /*resp*/) {});
 //        }
     }
+
+    // a trigger whose body is moved from the client socket to the worker
+    // socket through body's pipe; the worker gets a plain worker_push_request
+    template<typename Callback>
+    void start_trigger_splice(std::shared_ptr<basic::spliced_body> body, Callback next)
+    {
+        pack::packet_pointer pack = pack::make_packet();
+
+        pack->header.gen();
+        pack->header.type = pack::msg_t::worker_push_request;
+
+        auto j = std::allocate_shared<job>(pack::recycling_allocator<job>{}, io_context_, pack, std::move(next));
+        j->splice_ = std::move(body);
+        registered_jobs_.push(j);
+        started_jobs_.emplace(pack->header, j);
+        start_jobs();
+    }
+
+    // a trigger whose body of total bytes comes as chunks; they go to the
+    // returned body_stream, which passes them on to the worker
+    template<typename Callback>
+    auto start_trigger_stream(std::uint64_t total, Callback next) -> std::shared_ptr<body_stream>
+    {
+        pack::packet_pointer pack = pack::make_packet();
+
+        pack->header.gen();
+        pack->header.type = pack::msg_t::stream;
+        pack::stream_header{pack::msg_t::worker_push_request, total}.dump(pack->data);
+
+        auto j = std::allocate_shared<job>(pack::recycling_allocator<job>{}, io_context_, pack, std::move(next));
+        j->stream_ = std::make_shared<body_stream>(pack->header);
+        registered_jobs_.push(j);
+        started_jobs_.emplace(pack->header, j);
+        start_jobs();
+        return j->stream_;
+    }
 };
 
 } // namespace launcher
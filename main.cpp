@@ -1,45 +1,288 @@
 #include "basic.hpp"
+#include "alloc_counter.hpp"
+#include "busy_poll.hpp"
 #include "serializer.hpp"
 #include "trigger.hpp"
 #include "launcher.hpp"
+#include "compression.hpp"
+#include "durable_log.hpp"
+#include "elastic_pool.hpp"
+#include "flow_control.hpp"
+#include "handler_memory.hpp"
+#include "numa.hpp"
+#include "pipeline.hpp"
+#include "read_buffer.hpp"
+#include "spill.hpp"
+#include "stream.hpp"
+#include "topic_table.hpp"
+#include "write_queue.hpp"
 
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/asio.hpp>
-#include <boost/signals2.hpp>
 
-#include <oneapi/tbb/concurrent_unordered_map.h>
 #include <oneapi/tbb/concurrent_queue.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
 #include <iostream>
+#include <limits>
 
 #include <memory>
+#include <mutex>
 #include <array>
 #include <list>
+#include <optional>
 #include <thread>
 #include <vector>
 
 using net::ip::tcp;
 
-class bucket
+// a body waiting in a bucket, still counted against the connection that put it
+struct queued_message
+{
+    pack::packet_data data;
+    basic::charge charge;
+    std::uint64_t seq = 0; // of its put in the durable log; 0 = not logged
+};
+
+class bucket : public std::enable_shared_from_this<bucket>
 {
     net::io_context& io_context_;
     net::io_context::strand event_io_strand_;
+    basic::topic_key const key_;
+
+    // puts are logged here and pops logged as consumed; null for trigger
+    // buckets and when nothing is kept on disk
+    std::shared_ptr<basic::durable_log> log_;
+
+    // for receiving messages. their body bytes are counted here and in the
+    // topics-wide total, which the memory budget is checked against
+    oneapi::tbb::concurrent_queue<queued_message> message_queue_;
+    std::atomic<std::uint64_t> queued_bytes_ = 0;
+    std::atomic<std::uint64_t>& queued_total_;
 
-    // for receiving messages
-    oneapi::tbb::concurrent_queue<pack::packet_data> message_queue_;
+    // messages past the spill limits, all newer than those in
+    // message_queue_. once one is spilled, the ones after it follow it to
+    // the file until it drains, so the queue stays fifo. spilled_ and the
+    // byte counts can be read without spill_mutex_
+    basic::spill_limits const& spill_limits_;
+    std::mutex spill_mutex_;
+    std::optional<basic::spill_file> spill_;
+    std::atomic<std::size_t> spilled_ = 0;
+    std::atomic<std::uint64_t> spilled_bytes_ = 0;
+    std::atomic<std::uint64_t>& spilled_total_;
+    // spilled bodies read back for gets and not yet sent; null without spilling
+    std::shared_ptr<basic::watermark> read_back_;
+
+    // steady_clock ticks of the last lookup, for idle and lru eviction
+    std::atomic<std::chrono::steady_clock::rep> last_access_ = std::chrono::steady_clock::now().time_since_epoch().count();
 
     // to issue a request to binded http url when a message comes in
     std::shared_ptr<trigger::invoker<beast::ssl_stream<beast::tcp_stream>>> binding_;
 
-    // holds callbacks of listeners //
-    boost::signals2::signal<void (pack::packet_pointer)> listener_;
+    // get requests waiting for a message. firing_ is only touched on
+    // event_io_strand_; both keep their capacity across requests
+    std::mutex listener_mutex_;
+    std::vector<basic::callback<void (pack::packet_pointer)>> listeners_;
+    std::vector<basic::callback<void (pack::packet_pointer)>> firing_;
+
+    void queue(queued_message m)
+    {
+        queued_bytes_.fetch_add(m.data.buf.size(), std::memory_order_relaxed);
+        queued_total_.fetch_add(m.data.buf.size(), std::memory_order_relaxed);
+        message_queue_.push(std::move(m));
+    }
+
+    bool must_spill(std::size_t size) const
+    {
+        return spilled_.load(std::memory_order_relaxed) != 0 or
+               (spill_limits_.bucket != 0 and queued_bytes() + size > spill_limits_.bucket) or
+               (spill_limits_.total != 0 and queued_total_.load(std::memory_order_relaxed) + size > spill_limits_.total);
+    }
+
+    // spill_mutex_ must be held. the body no longer counts against the
+    // connection that put it once it is on disk
+    bool spill(queued_message const& m)
+    {
+        if (not spill_)
+            spill_.emplace(spill_limits_.dir);
+        if (not spill_->push(m.data, m.seq))
+            return false;
+        if (spilled_.fetch_add(1, std::memory_order_relaxed) == 0)
+            BOOST_LOG_TRIVIAL(debug) << "bucket spills to disk with " << queued_bytes() << " bytes queued in memory";
+        spilled_bytes_.fetch_add(m.data.buf.size(), std::memory_order_relaxed);
+        spilled_total_.fetch_add(m.data.buf.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop_queued(queued_message& m)
+    {
+        if (not message_queue_.try_pop(m))
+            return false;
+        queued_bytes_.fetch_sub(m.data.buf.size(), std::memory_order_relaxed);
+        queued_total_.fetch_sub(m.data.buf.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop_spilled(queued_message& m)
+    {
+        if (spilled_.load(std::memory_order_relaxed) == 0)
+            return false;
+
+        std::scoped_lock lock{spill_mutex_};
+        if (not spill_ or spill_->empty())
+            return false;
+        if (not spill_->pop(m.data, m.seq))
+        {
+            BOOST_LOG_TRIVIAL(error) << "bucket drops " << spill_->size() << " spilled messages it can not read back";
+            drop_spilled();
+            return false;
+        }
+        m.charge = basic::charge{};
+        spilled_.fetch_sub(1, std::memory_order_relaxed);
+        spilled_bytes_.fetch_sub(m.data.buf.size(), std::memory_order_relaxed);
+        spilled_total_.fetch_sub(m.data.buf.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // spill_mutex_ must be held, or the bucket be going away
+    void drop_spilled()
+    {
+        if (not spill_)
+            return;
+        if (log_)
+            spill_->for_each_seq([this] (std::uint64_t seq) { log_->consume(seq); });
+        spill_->close();
+        spilled_total_.fetch_sub(spilled_bytes_.exchange(0), std::memory_order_relaxed);
+        spilled_.store(0, std::memory_order_relaxed);
+    }
+
+    void consumed(queued_message const& m)
+    {
+        if (log_ and m.seq != 0)
+            log_->consume(m.seq);
+    }
+
+    // the oldest message, spilled or not
+    bool try_pop(queued_message& m)
+    {
+        if (not pop_queued(m) and not pop_spilled(m))
+            return false;
+        consumed(m);
+        return true;
+    }
+
+    // runs on event_io_strand_: every message queued goes to the gets
+    // waiting. spilled ones are read back while the responses read back
+    // before them and not yet sent stay under read_back_; the rest goes
+    // to the same gets in handlers of their own as those are sent, until
+    // the bucket is drained
+    void fire_listeners(pack::packet_header const& header)
+    {
+        if (firing_.empty())
+        {
+            std::scoped_lock lock{listener_mutex_};
+            BOOST_LOG_TRIVIAL(trace) << "start listener events. listener empty=" << listeners_.empty() << ", mqueue empty=" << empty();
+            if (listeners_.empty() or empty())
+                return;
+            std::swap(listeners_, firing_);
+        }
+
+        BOOST_LOG_TRIVIAL(trace) << "running listener events";
+        // each response owns its body: writes send it without copying,
+        // so it must stay untouched until the write completes
+        auto fire = [this, &header] (pack::packet_pointer resp, queued_message& m) {
+            consumed(m);
+            resp->data = std::move(m.data);
+            resp->header = header;
+            resp->header.type = pack::msg_t::ack;
+            for (auto& listener : firing_)
+                listener(resp);
+        };
+
+        queued_message m;
+        while (pop_queued(m))
+            fire(pack::make_packet(), m);
+
+        if (read_back_)
+        {
+            while (not read_back_->blocked() and pop_spilled(m))
+            {
+                std::uint64_t const size = m.data.buf.size();
+                fire(basic::make_charged_packet(basic::charge{read_back_, nullptr, size}), m);
+            }
+
+            if (spilled_.load(std::memory_order_relaxed) != 0)
+            {
+                if (not read_back_->wait_if_blocked([self=shared_from_this(), header] { self->start_fire_listeners(header); }))
+                    start_fire_listeners(header);
+                return;
+            }
+        }
+
+        BOOST_LOG_TRIVIAL(trace) << "clear listeners";
+        firing_.clear();
+
+        // gets that came while the spill file drained
+        std::scoped_lock lock{listener_mutex_};
+        if (not listeners_.empty() and not empty())
+            start_fire_listeners(header);
+    }
+
+    void start_fire_listeners(pack::packet_header const& header)
+    {
+        net::post(
+            io_context_,
+            net::bind_executor(
+                event_io_strand_,
+                basic::recycled([self=shared_from_this(), header] {
+                    self->fire_listeners(header);
+                })));
+    }
 
 public:
-    bucket(net::io_context& io):
+    bucket(net::io_context& io, basic::topic_key const& key,
+           std::atomic<std::uint64_t>& queued_total, std::atomic<std::uint64_t>& spilled_total,
+           basic::spill_limits const& spill_limits, std::shared_ptr<basic::durable_log> log):
         io_context_{io},
-        event_io_strand_{io} {}
+        event_io_strand_{io},
+        key_{key},
+        log_{std::move(log)},
+        queued_total_{queued_total},
+        spill_limits_{spill_limits},
+        spilled_total_{spilled_total}
+    {
+        if (spill_limits_.enabled())
+            read_back_ = std::make_shared<basic::watermark>(
+                basic::limits{spill_limits_.read_back(), spill_limits_.read_back() / 2});
+    }
+
+    // what is spilled is not read back just to be thrown away
+    ~bucket()
+    {
+        queued_message m;
+        while (pop_queued(m))
+            consumed(m);
+        drop_spilled();
+    }
+
+    void touch() { last_access_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed); }
+    auto last_access() const -> std::chrono::steady_clock::time_point
+    {
+        return std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{last_access_.load(std::memory_order_relaxed)}};
+    }
+    auto queued_bytes() const -> std::uint64_t { return queued_bytes_.load(std::memory_order_relaxed); }
+    auto spilled_bytes() const -> std::uint64_t { return spilled_bytes_.load(std::memory_order_relaxed); }
+    bool empty() const { return message_queue_.empty() and spilled_.load(std::memory_order_relaxed) == 0; }
+
+    bool has_listeners()
+    {
+        std::scoped_lock lock{listener_mutex_};
+        return not listeners_.empty();
+    }
 
     void to_trigger()
     {
@@ -57,11 +300,33 @@ public:
     template<typename Function>
     void get_connect(Function &&f)
     {
-        listener_.connect(std::forward<Function>(f));
+        std::scoped_lock lock{listener_mutex_};
+        listeners_.emplace_back(std::forward<Function>(f));
     }
 
-    template<typename Msg>
-    void push_message(Msg && m) { message_queue_.push(std::forward<Msg>(m)); }
+    // logged before it is queued, so its consume can only be logged after it
+    void push_message(queued_message m)
+    {
+        if (log_ and m.seq == 0)
+            m.seq = log_->append(key_, m.data);
+        if (not spill_limits_.enabled())
+        {
+            queue(std::move(m));
+            return;
+        }
+
+        // decided and queued under the lock, so no message is queued in
+        // memory after one that went to the file before it
+        std::scoped_lock lock{spill_mutex_};
+        if (must_spill(m.data.buf.size()))
+        {
+            if (spill(m))
+                return;
+            if (spilled_.load(std::memory_order_relaxed) != 0)
+                BOOST_LOG_TRIVIAL(error) << "bucket can not spill a message; it is queued ahead of older spilled ones";
+        }
+        queue(std::move(m));
+    }
 
     void start_handle_events(pack::packet_pointer key)
     {
@@ -70,273 +335,1090 @@ public:
             io_context_,
             net::bind_executor(
                 event_io_strand_,
-                [this, key] {
+                basic::recycled([this, self=shared_from_this(), key] {
                     BOOST_LOG_TRIVIAL(trace) << "start_handle_events runed";
-                    pack::packet_pointer resp = std::make_shared<pack::packet>();
-                    resp->header = key->header;
-                    resp->header.type = pack::msg_t::ack;
-
-                    if (resp->header.is_trigger())
+                    if (key->header.is_trigger())
                     {
                         BOOST_LOG_TRIVIAL(trace) << "post as trigger";
-                        while (message_queue_.try_pop(resp->data))
+                        queued_message m;
+                        while (try_pop(m))
                         {
+                            pack::packet_data data = std::move(m.data);
+                            if (data.compressed)
+                            {
+                                pack::packet_data plain;
+                                if (not pack::decompress(data, plain))
+                                {
+                                    BOOST_LOG_TRIVIAL(error) << "bad compressed body for trigger " << key->header;
+                                    continue;
+                                }
+                                data = std::move(plain);
+                            }
+
                             // trigger
                             std::string body;
-                            std::copy(key->data.buf.begin(),
-                                      key->data.buf.end(),
+                            std::copy(data.buf.begin(),
+                                      data.buf.end(),
                                       std::back_inserter(body));
                             start_trigger_post(body);
                         }
                     }
                     else
-                    {
-                        BOOST_LOG_TRIVIAL(trace) << "start listener events. listener empty=" << listener_.empty() << ", mqueue empty=" << message_queue_.empty();
-                        if (listener_.empty() or message_queue_.empty())
-                            return;
+                        fire_listeners(key->header);
+                })));
+    }
 
-                        BOOST_LOG_TRIVIAL(trace) << "running listener events";
-                        while (message_queue_.try_pop(resp->data))
-                            listener_(resp);
+};
 
-                        BOOST_LOG_TRIVIAL(trace) << "clear listener_ ";
-                        listener_.disconnect_all_slots();
-                    }
-                }));
+// buckets by key and salt, in a basic::topic_table: a lookup shares the
+// lock of one shard, only inserting and evicting take it exclusively.
+// with --shards, every io_context has a table of its own, picked by the
+// hash of the key, so a bucket's events and the sweeps of its table run
+// on the thread of its shard whichever connection used it.
+// a bucket is evicted only while the table holds the sole reference to
+// it and no get waits on it:
+//  - once it has been empty and unused for the ttl
+//  - or, once the buckets take more than the memory budget, least
+//    recently used first until they are back under 90% of it, dropping
+//    whatever they still queue
+// with a durable log, what buckets queue is also kept on disk. with spill
+// limits, what is over them waits in spill files, which only the buckets'
+// memory is not budgeted for
+class topics
+{
+    struct part
+    {
+        net::io_context& io;
+        basic::topic_table<std::shared_ptr<bucket>> buckets;
+        std::atomic<bool> sweep_posted = false;
+        std::optional<net::steady_timer> timer;
+
+        part(net::io_context& i): io{i} {}
+    };
+
+    std::vector<std::unique_ptr<part>> parts_;
+    std::atomic<std::uint64_t> queued_total_ = 0;
+    std::atomic<std::uint64_t> spilled_total_ = 0;
+    std::atomic<std::size_t> size_ = 0;
+    std::shared_ptr<basic::durable_log> log_;
+    basic::spill_limits spill_limits_;
+
+    std::chrono::seconds ttl_ {0};   // 0 = never evict for idleness
+    std::uint64_t budget_ = 0;       // 0 = no memory budget
+
+    // the table must be locked exclusively for this to be exact
+    static bool evictable(std::shared_ptr<bucket> const& b)
+    {
+        return b.use_count() == 1 and not b->has_listeners();
+    }
+
+    // the high bits: topic_table already uses the low ones
+    auto part_of(basic::topic_key const& k) -> part&
+    {
+        return *parts_[(k.hash() >> 48) % parts_.size()];
+    }
+
+public:
+    // rough cost of an empty bucket with its table slot, counted against the budget
+    static constexpr std::uint64_t bucket_overhead = sizeof(bucket) + sizeof(basic::topic_key) + 2 * sizeof(void*) + 64;
+
+    // one table per io_context
+    template<typename Contexts>
+    topics(Contexts const& contexts)
+    {
+        for (auto const& io : contexts)
+            parts_.push_back(std::make_unique<part>(*io));
+    }
+
+    // both set before any bucket is made
+    void persist(std::shared_ptr<basic::durable_log> log) { log_ = std::move(log); }
+    void spill(basic::spill_limits limits) { spill_limits_ = std::move(limits); }
+
+    auto get(pack::packet_header const& h) -> std::shared_ptr<bucket>
+    {
+        basic::topic_key const k = basic::topic_key::of(h);
+        part& p = part_of(k);
+        std::shared_ptr<bucket> b = p.buckets.find_or_emplace(
+            k,
+            [this, &p, &k, trigger = h.is_trigger()] {
+                size_.fetch_add(1, std::memory_order_relaxed);
+                return std::make_shared<bucket>(p.io, k, queued_total_, spilled_total_, spill_limits_,
+                                                trigger? nullptr: log_);
+            });
+        b->touch();
+
+        if (over_budget() and not p.sweep_posted.exchange(true))
+            net::post(p.io, [this, &p] { sweep(p); });
+        return b;
+    }
+
+    // queues a message recovered from the log in its bucket again
+    void restore(basic::topic_key const& k, std::uint64_t seq, pack::packet_data data)
+    {
+        part& p = part_of(k);
+        std::shared_ptr<bucket> b = p.buckets.find_or_emplace(
+            k,
+            [this, &p, &k] {
+                size_.fetch_add(1, std::memory_order_relaxed);
+                return std::make_shared<bucket>(p.io, k, queued_total_, spilled_total_, spill_limits_, log_);
+            });
+        b->push_message(queued_message{std::move(data), basic::charge{}, seq});
+    }
+
+    auto memory() const -> std::uint64_t
+    {
+        return queued_total_.load(std::memory_order_relaxed) + size_.load(std::memory_order_relaxed) * bucket_overhead;
+    }
+
+    bool over_budget() const { return budget_ != 0 and memory() > budget_; }
+
+    // sweeps every table every interval on its io_context: ttl / 4, at most a second
+    void start_eviction(std::chrono::seconds ttl, std::uint64_t budget)
+    {
+        ttl_ = ttl;
+        budget_ = budget;
+        if (ttl_.count() == 0 and budget_ == 0)
+            return;
+        for (auto& p : parts_)
+        {
+            p->timer.emplace(p->io);
+            start_sweep_timer(*p);
+        }
+    }
+
+    // the budget is shared: a table evicts its own least recently used
+    // buckets until all of them are back under it
+    void sweep(part& p)
+    {
+        p.sweep_posted.store(false);
+        auto const now = std::chrono::steady_clock::now();
+        std::size_t idle = 0, lru = 0;
+        std::uint64_t dropped = 0;
+
+        if (ttl_.count() != 0)
+        {
+            idle = p.buckets.erase_if([this, now] (basic::topic_key const&, std::shared_ptr<bucket> const& b) {
+                return evictable(b) and b->empty() and now - b->last_access() >= ttl_;
+            });
+            size_.fetch_sub(idle, std::memory_order_relaxed);
+        }
+
+        if (over_budget())
+        {
+            std::vector<std::pair<std::chrono::steady_clock::time_point, basic::topic_key>> candidates;
+            p.buckets.for_each([&candidates] (basic::topic_key const& k, std::shared_ptr<bucket> const& b) {
+                if (evictable(b))
+                    candidates.emplace_back(b->last_access(), k);
+            });
+            std::sort(candidates.begin(), candidates.end(),
+                      [] (auto const& a, auto const& b) { return a.first < b.first; });
+
+            for (auto const& [last_access, k] : candidates)
+            {
+                if (memory() <= budget_ / 10 * 9)
+                    break;
+                std::uint64_t bytes = 0;
+                bool const erased = p.buckets.erase_if(k, [&bytes] (std::shared_ptr<bucket> const& b) {
+                    bytes = b->queued_bytes() + b->spilled_bytes();
+                    return evictable(b);
+                });
+                if (erased)
+                {
+                    size_.fetch_sub(1, std::memory_order_relaxed);
+                    dropped += bytes;
+                    lru++;
+                }
+            }
+        }
+
+        if (idle != 0 or lru != 0)
+            BOOST_LOG_TRIVIAL(info) << "topics evicted " << idle << " idle and " << lru << " lru buckets"
+                                    << " (" << dropped << " queued bytes dropped); "
+                                    << size_.load() << " buckets, " << memory() << " bytes left";
+        if (over_budget())
+            BOOST_LOG_TRIVIAL(error) << "topics over budget with every bucket in use: " << memory() << " bytes";
+    }
+
+private:
+    void start_sweep_timer(part& p)
+    {
+        auto const interval = (ttl_.count() == 0)? std::chrono::seconds{1}:
+            std::clamp<std::chrono::seconds>(ttl_ / 4, std::chrono::seconds{1}, std::chrono::seconds{60});
+        p.timer->expires_after(interval);
+        p.timer->async_wait(
+            [this, &p] (boost::system::error_code ec) {
+                if (ec)
+                    return;
+                sweep(p);
+                start_sweep_timer(p);
+            });
     }
 };
 
-using topics =
-    oneapi::tbb::concurrent_unordered_map<
-        pack::packet_header,
-        bucket,
-        pack::packet_header_key_hash,
-        pack::packet_header_key_compare>;
+// collects the replies to the sub packets of one batch frame and
+// writes them back as a single batch frame once every one has answered.
+// gets are not collected: one may wait on an empty bucket for as long as
+// it likes, so they answer on their own, like a get outside a batch
+class batch_reply
+{
+    pack::packet_header header_;
+    std::vector<pack::packet_pointer> replies_;
+    std::vector<pack::packet_pointer> extras_;
+    std::size_t remaining_;
+    std::mutex mutex_;
+    basic::callback<void (pack::packet_pointer)> write_;
+
+public:
+    template<typename Function>
+    batch_reply(pack::packet_header const& h, std::size_t size, Function &&f):
+        header_{h}, replies_(size), remaining_{size}, write_{std::forward<Function>(f)} {}
+
+    void flush_if_empty()
+    {
+        if (replies_.empty())
+            write_(pack::make_batch(header_, replies_));
+    }
+
+    void set(std::size_t index, pack::packet_pointer resp)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+
+        // a streamed worker response answers more than once; extra
+        // answers go out on their own, after the batch frame itself
+        if (replies_.at(index))
+        {
+            if (remaining_ != 0)
+            {
+                extras_.push_back(resp);
+                return;
+            }
+            lock.unlock();
+            write_(resp);
+            return;
+        }
+
+        replies_[index] = resp;
+        if (--remaining_ == 0)
+        {
+            lock.unlock();
+            write_(pack::make_batch(header_, replies_));
+            for (pack::packet_pointer& extra : extras_)
+                write_(extra);
+            extras_.clear();
+        }
+    }
+};
 
 class tcp_connection : public std::enable_shared_from_this<tcp_connection>
 {
     net::io_context& io_context_;
     topics& topics_;
-    tcp::socket socket_;
-    net::io_context::strand write_io_strand_;
+    basic::stream_socket socket_;
+    basic::read_buffer reader_;
+    basic::flow_control flow_;
+    basic::write_queue<basic::stream_socket> write_queue_;
     launcher::launcher& launcher_;
 
+    // read_loop runs here; resume_ wakes it after a pause.
+    // its awaitables name the strand type, so resuming never boxes the
+    // strand into an any_io_executor (a heap allocation per read)
+    using strand_type = net::strand<net::io_context::executor_type>;
+    template<typename T>
+    using awaitable = net::awaitable<T, strand_type>;
+    static constexpr net::use_awaitable_t<strand_type> use_awaitable{};
+
+    strand_type strand_;
+    net::steady_timer resume_;
+
+    // null unless --pipeline-depth is set: replies then go out as they complete
+    std::unique_ptr<basic::pipeline> pipeline_;
+
+    // wire header version; 2 = pack::compact_header with keys_ bindings
+    std::atomic<int> version_ = 1;
+    pack::key_table keys_;
+
+    // streamed trigger body being read, and where its chunks go. pieces
+    // count against stream_window_ until the worker got them
+    std::optional<basic::stream_state> inbound_stream_;
+    std::shared_ptr<launcher::body_stream> inbound_sink_;
+    std::shared_ptr<basic::watermark> stream_window_;
+    bool streams_ = false; // replies may be streamed; capability::streams in hello
+
 public:
     using pointer = std::shared_ptr<tcp_connection>;
 
-    tcp_connection(net::io_context& io, topics& s, tcp::socket socket, launcher::launcher &l):
+    tcp_connection(net::io_context& io, topics& s, basic::stream_socket socket, launcher::launcher &l,
+                   std::size_t pipeline_depth, basic::flow_limits const& flow, basic::global_flow& global):
         io_context_{io},
         topics_{s},
         socket_{std::move(socket)},
-        write_io_strand_{io},
-        launcher_{l} {}
+        flow_{flow, global},
+        write_queue_{socket_, &flow_},
+        launcher_{l},
+        strand_{net::make_strand(io)},
+        resume_{io},
+        stream_window_{std::make_shared<basic::watermark>(basic::limits{flow.stream_window, flow.stream_window / 2})}
+    {
+        if (pipeline_depth != 0)
+            pipeline_ = std::make_unique<basic::pipeline>(pipeline_depth);
+    }
 
-    auto socket() -> tcp::socket& { return socket_; }
+    auto socket() -> basic::stream_socket& { return socket_; }
 
-    auto get_bucket(pack::packet_header &h) -> bucket&
+    auto get_bucket(pack::packet_header &h) -> std::shared_ptr<bucket>
     {
-        if (not topics_.contains(h))
-            topics_.emplace(h, io_context_);
-        return topics_.at(h);
+        return topics_.get(h);
     }
 
-    void start_read_header()
+    // reply callable for the request being decoded right now. it keeps the
+    // header version the request came in with, so the ack of a hello still
+    // goes out in v1 even if it is released after the switch
+    auto replier()
     {
-        BOOST_LOG_TRIVIAL(trace) << "start_read_header";
-        auto read_buf = std::make_shared<std::array<pack::unit_t, pack::packet_header::bytesize>>();
-        net::async_read(
-            socket_,
-            net::buffer(read_buf->data(), read_buf->size()),
-            [self=shared_from_this(), read_buf] (boost::system::error_code ec, std::size_t /*length*/) {
-                if (not ec)
-                {
-                    pack::packet_pointer pack = std::make_shared<pack::packet>();
-                    pack->header.parse(read_buf->data());
+        std::uint64_t const index = pipeline_? pipeline_->open(): 0;
+        return [self=shared_from_this(), index, version=version_.load()] (pack::packet_pointer resp) {
+            if (not self->pipeline_)
+            {
+                self->start_write(resp, version);
+                return;
+            }
 
-                    switch (pack->header.type)
-                    {
-                    case pack::msg_t::put:
-                        BOOST_LOG_TRIVIAL(debug) << "put " << pack->header;
-                        self->start_read_body(pack);
-                        break;
-
-                    case pack::msg_t::get:
-                        BOOST_LOG_TRIVIAL(debug) << "get " << pack->header;
-                        self->start_load(pack);
-                        self->start_read_header();
-                        break;
-
-                    case pack::msg_t::ack:
-                    {
-                        BOOST_LOG_TRIVIAL(error) << "server should not get ack. error: " << pack->header;
-                        pack::packet_pointer resp = std::make_shared<pack::packet>();
-                        resp->header = pack->header;
-                        resp->header.type = pack::msg_t::ack;
-                        self->start_write(resp);
-                        self->start_read_header();
-                        break;
-                    }
+            bool const resume = self->pipeline_->complete(
+                index, resp,
+                [&self, version] (pack::packet_pointer p) { self->start_write(p, version); });
+            if (resume)
+                self->resume_reading();
+        };
+    }
 
-                    case pack::msg_t::worker_reg:
-                        BOOST_LOG_TRIVIAL(info) << "server add worker" << pack->header;
-                        self->launcher_.add_worker(std::move(self->socket_), pack);
-                        self->launcher_.start_jobs();
-                        break;
-
-                    case pack::msg_t::trigger:
-                        BOOST_LOG_TRIVIAL(debug) << "server get new trigger " << pack->header;
-                        self->start_trigger(pack);
-                        break;
-
-                    case pack::msg_t::err:
-                    case pack::msg_t::worker_dereg:
-                    case pack::msg_t::worker_push_request:
-                    case pack::msg_t::worker_response:
-                    {
-                        BOOST_LOG_TRIVIAL(error) << "packet error " << pack->header;
-                        pack::packet_pointer resp = std::make_shared<pack::packet>();
-                        resp->header = pack->header;
-                        resp->header.type = pack::msg_t::err;
-                        self->start_write(resp);
-                        self->start_read_header();
-                        break;
-                    }
-                    }
-                }
-                else
+    // replies to requests that did not set flag::compressed go out decompressed
+    template<typename Reply>
+    static auto decompressing(pack::packet_pointer request, Reply reply)
+    {
+        return [accepts=request->header.is_compressed(), reply] (pack::packet_pointer resp) {
+            if (resp->data.compressed and not accepts)
+            {
+                pack::packet_pointer plain = pack::make_packet();
+                plain->header = resp->header;
+                if (not pack::decompress(resp->data, plain->data))
                 {
-                    if (ec != boost::asio::error::eof)
-                        BOOST_LOG_TRIVIAL(error) << "start_read_header err: " << ec.message();
+                    BOOST_LOG_TRIVIAL(error) << "bad compressed body " << resp->header;
+                    plain->header.type = pack::msg_t::err;
                 }
-            });
+                resp = plain;
+            }
+            reply(resp);
+        };
     }
 
-    void start_trigger(pack::packet_pointer pack)
+    // header size of the next frame if all of it is buffered, 0 otherwise
+    auto buffered_header_size() -> std::size_t
     {
-        BOOST_LOG_TRIVIAL(trace) << "start_trigger";
-        auto read_buf = std::make_shared<std::string>(pack->header.datasize, 0);
-        net::async_read(
-            socket_,
-            net::buffer(read_buf->data(), read_buf->size()),
-            [self=shared_from_this(), read_buf, pack] (boost::system::error_code ec, std::size_t /*length*/) {
-                if (not ec)
+        std::size_t const available = reader_.size();
+        if (version_ == 2)
+        {
+            if (available < pack::compact_header::min_bytesize)
+                return 0;
+            std::size_t const size = pack::compact_header::min_bytesize +
+                                     pack::compact_header::remaining_bytesize(reader_.data());
+            return (available >= size)? size: 0;
+        }
+        return (available >= pack::packet_header::bytesize)? pack::packet_header::bytesize: 0;
+    }
+
+    void start_read()
+    {
+        net::co_spawn(strand_, read_loop(shared_from_this()), net::detached);
+    }
+
+    // one coroutine per connection, living as long as the socket is read.
+    // decodes every frame already in reader_ before going back to the socket.
+    // self only keeps the connection alive while the coroutine runs
+    auto read_loop([[maybe_unused]] pointer self) -> awaitable<void>
+    {
+        BOOST_LOG_TRIVIAL(trace) << "read_loop starts";
+        SCOPE_DEFER([this] {
+            if (inbound_sink_)
+                inbound_sink_->abort();
+        });
+
+        boost::system::error_code ec;
+        for (;;)
+        {
+            if (flow_.wait_if_blocked([this] { return [self=shared_from_this()] { self->resume_reading(); }; }))
+            {
+                BOOST_LOG_TRIVIAL(debug) << "watermark reached, pause reading";
+                co_await pause_reading();
+                continue;
+            }
+
+            // a full pipeline still lets the chunks of the open stream in:
+            // its reply, which frees a slot, needs the whole body
+            bool const pipeline_full = pipeline_ and pipeline_->pause_if_full();
+            if (pipeline_full and not inbound_stream_)
+            {
+                BOOST_LOG_TRIVIAL(trace) << "pipeline full, pause reading";
+                co_await pause_reading();
+                continue;
+            }
+
+            std::size_t const header_size = buffered_header_size();
+            if (header_size == 0)
+            {
+                std::size_t const length = co_await socket_.async_read_some(
+                    reader_.prepare(), net::redirect_error(use_awaitable, ec));
+                if (ec)
                 {
-                    self->launcher_.start_trigger_post(
-                        *read_buf,
-                        [self, pack] (pack::packet_pointer resp) {
-                            self->start_write(resp);
-                            self->start_read_header();
-                        });
-//                    self->start_write(pack);
-//                    self->start_read_header();
+                    if (ec != boost::asio::error::eof)
+                        BOOST_LOG_TRIVIAL(error) << "read_loop err: " << ec.message();
+                    co_return;
                 }
-                else
-                    BOOST_LOG_TRIVIAL(error) << "start_trigger: " << ec.message();
-            });
+                reader_.commit(length);
+                continue;
+            }
+
+            pack::packet_pointer pack = pack::make_packet();
+            std::uint32_t key_id = 0;
+            bool bound = true;
+            if (version_ == 2)
+            {
+                auto const status = pack::compact_header::parse(keys_, pack->header, key_id, reader_.data());
+                if (status == pack::compact_header::status::bad_size)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "read_loop: datasize over 32 bits, closing";
+                    co_return;
+                }
+                bound = (status == pack::compact_header::status::bound);
+            }
+            else
+                pack->header.parse(reader_.data());
+
+            if (pipeline_full and not (bound and inbound_stream_->continued_by(pack->header)))
+            {
+                // left in reader_, parsed again once a slot is free
+                BOOST_LOG_TRIVIAL(trace) << "pipeline full, pause reading";
+                co_await pause_reading();
+                continue;
+            }
+            reader_.consume(header_size);
+            basic::alloc_counter::count_frame();
+
+            if (pack->header.type == pack::msg_t::trigger and bound and
+                not pack->header.is_compressed() and launcher_.splices(pack->header.datasize))
+            {
+                if (not co_await splice_trigger(pack, ec))
+                {
+                    BOOST_LOG_TRIVIAL(error) << "read_loop splice: " << ec.message();
+                    co_return;
+                }
+                continue;
+            }
+
+            if (inbound_stream_ and bound and inbound_stream_->continued_by(pack->header))
+            {
+                if (not co_await forward_chunk(pack->header.datasize, ec))
+                {
+                    BOOST_LOG_TRIVIAL(error) << "read_loop chunk: " << ec.message();
+                    co_return;
+                }
+                continue;
+            }
+
+            std::uint32_t const size = pack->header.datasize;
+            pack::unit_t* const body = pack->data.allocate(size);
+            pack->data.compressed = pack->header.is_compressed();
+            std::size_t const buffered = reader_.take(body, size);
+
+            if (buffered < size)
+            {
+                // the rest of a large body goes straight into its final buffer
+                co_await net::async_read(
+                    socket_,
+                    net::buffer(body + buffered, size - buffered),
+                    net::redirect_error(use_awaitable, ec));
+                if (ec)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "read_loop body: " << ec.message();
+                    co_return;
+                }
+            }
+
+            switch (on_frame(pack, key_id, bound))
+            {
+            case next_step::read:
+                break;
+            case next_step::wait:
+                co_await pause_reading();
+                break;
+            case next_step::stop:
+                co_return;
+            }
+        }
+    }
+
+    // passes a chunk of the streamed trigger body on in pieces while it
+    // arrives, holding at most the window; returns false if the socket failed
+    auto forward_chunk(std::uint64_t left, boost::system::error_code& ec) -> awaitable<bool>
+    {
+        inbound_stream_->remaining -= left;
+        while (left != 0)
+        {
+            if (stream_window_->wait_if_blocked([self=shared_from_this()] { self->resume_reading(); }))
+            {
+                co_await pause_reading();
+                continue;
+            }
+
+            std::size_t const size = std::min<std::uint64_t>(left, basic::stream_piece_size);
+            pack::packet_pointer piece = basic::make_charged_packet(basic::charge{stream_window_, nullptr, size});
+            pack::unit_t* const body = piece->data.allocate(size);
+            std::size_t const buffered = reader_.take(body, size);
+            if (buffered < size)
+            {
+                co_await net::async_read(
+                    socket_,
+                    net::buffer(body + buffered, size - buffered),
+                    net::redirect_error(use_awaitable, ec));
+                if (ec)
+                    co_return false;
+            }
+
+            inbound_sink_->forward(piece);
+            left -= size;
+        }
+
+        if (inbound_stream_->remaining == 0)
+        {
+            inbound_stream_.reset();
+            inbound_sink_.reset();
+        }
+        co_return true;
+    }
+
+    // suspends read_loop until resume_reading()
+    auto pause_reading() -> awaitable<void>
+    {
+        boost::system::error_code ec;
+        resume_.expires_at(net::steady_timer::time_point::max());
+        co_await resume_.async_wait(net::redirect_error(use_awaitable, ec));
+    }
+
+    // read_loop only suspends on strand_, and the cancel is posted there too,
+    // so it can never run before the wait it is meant to end
+    void resume_reading()
+    {
+        net::post(strand_, basic::recycled([self=shared_from_this()] { self->resume_.cancel(); }));
+    }
+
+    // what read_loop does after a frame
+    enum class next_step : std::uint8_t
+    {
+        read,
+        wait, // until resume_reading()
+        stop  // the socket was handed over
+    };
+
+    // handles one complete frame
+    auto on_frame(pack::packet_pointer pack, std::uint32_t key_id, bool bound) -> next_step
+    {
+        if (pack->header.type == pack::msg_t::worker_reg)
+        {
+            BOOST_LOG_TRIVIAL(info) << "server add worker" << pack->header;
+            launcher_.add_worker(std::move(socket_), pack, std::move(reader_));
+            launcher_.start_jobs();
+            return next_step::stop;
+        }
+
+        auto reply = replier();
+        if (pack->header.in_memfd())
+        {
+            // only workers pass bodies as memfd
+            BOOST_LOG_TRIVIAL(error) << "memfd body from a client " << pack->header;
+            pack::packet_pointer resp = pack::make_packet();
+            resp->header = pack->header;
+            resp->header.type = pack::msg_t::err;
+            resp->header.flags = 0;
+            reply(resp);
+            return next_step::read;
+        }
+
+        if (version_ == 2)
+        {
+            if (pack->header.type == pack::msg_t::key_bind)
+            {
+                on_key_bind(pack, key_id, reply);
+                return next_step::read;
+            }
+
+            if (not bound)
+            {
+                BOOST_LOG_TRIVIAL(error) << "unbound key id " << key_id << " " << pack->header;
+                pack::packet_pointer resp = pack::make_packet();
+                resp->header = pack->header;
+                resp->header.type = pack::msg_t::err;
+                reply(resp);
+                return next_step::read;
+            }
+        }
+
+        switch (pack->header.type)
+        {
+        case pack::msg_t::put:
+            BOOST_LOG_TRIVIAL(debug) << "put " << pack->header;
+            start_store(pack, reply);
+            return next_step::read;
+
+        case pack::msg_t::get:
+            BOOST_LOG_TRIVIAL(debug) << "get " << pack->header;
+            start_load(pack, reply);
+            return next_step::read;
+
+        case pack::msg_t::batch:
+            BOOST_LOG_TRIVIAL(debug) << "batch " << pack->header;
+            start_batch(pack, reply);
+            return next_step::read;
+
+        case pack::msg_t::hello:
+            BOOST_LOG_TRIVIAL(debug) << "hello " << pack->header;
+            on_hello(pack, reply);
+            return next_step::read;
+
+        case pack::msg_t::trigger:
+            BOOST_LOG_TRIVIAL(debug) << "server get new trigger " << pack->header;
+            start_trigger(pack, reply);
+            // without a pipeline, wait for the worker before reading on
+            return pipeline_? next_step::read: next_step::wait;
+
+        case pack::msg_t::stream:
+            BOOST_LOG_TRIVIAL(debug) << "server get new stream " << pack->header;
+            // reading goes on: the chunks that follow are the body
+            start_trigger_stream(pack, reply);
+            return next_step::read;
+
+        case pack::msg_t::ack:
+        {
+            BOOST_LOG_TRIVIAL(error) << "server should not get ack. error: " << pack->header;
+            pack::packet_pointer resp = pack::make_packet();
+            resp->header = pack->header;
+            resp->header.type = pack::msg_t::ack;
+            reply(resp);
+            return next_step::read;
+        }
+
+        case pack::msg_t::err:
+        case pack::msg_t::worker_reg:
+        case pack::msg_t::worker_dereg:
+        case pack::msg_t::worker_push_request:
+        case pack::msg_t::worker_response:
+        case pack::msg_t::chunk: // not of the open stream
+        case pack::msg_t::key_bind:
+        {
+            BOOST_LOG_TRIVIAL(error) << "packet error " << pack->header;
+            pack::packet_pointer resp = pack::make_packet();
+            resp->header = pack->header;
+            resp->header.type = pack::msg_t::err;
+            reply(resp);
+            return next_step::read;
+        }
+        }
+        return next_step::read;
+    }
+
+    // body = [requested version][capabilities]; the ack carries the accepted
+    // ones and, if the version is 2, both sides switch to pack::compact_header
+    // right after it. a peer that sends only the version takes no capability
+    template<typename Reply>
+    void on_hello(pack::packet_pointer pack, Reply reply)
+    {
+        int const requested = pack->data.buf.empty()? 1: pack->data.buf.front();
+        int const accepted = std::clamp(requested, 1, 2);
+        pack::unit_t const capabilities = (pack->data.buf.size() < 2)? 0: pack->data.buf[1] & pack::capability::streams;
+
+        pack::packet_pointer resp = pack::make_packet();
+        resp->header = pack->header;
+        resp->header.type = pack::msg_t::ack;
+        pack::unit_t* const body = resp->data.allocate(pack->data.buf.size() < 2? 1: 2);
+        body[0] = static_cast<pack::unit_t>(accepted);
+        if (resp->data.buf.size() == 2)
+            body[1] = capabilities;
+        reply(resp);
+
+        version_ = accepted;
+        streams_ = capabilities & pack::capability::streams;
+    }
+
+    // body = the 32 byte key to bind to key_id
+    template<typename Reply>
+    void on_key_bind(pack::packet_pointer pack, std::uint32_t key_id, Reply reply)
+    {
+        pack::packet_pointer resp = pack::make_packet();
+        resp->header = pack->header;
+        resp->header.type = pack::msg_t::err;
+
+        if (pack->data.buf.size() == std::tuple_size<pack::key_t>::value)
+        {
+            std::copy(pack->data.buf.begin(), pack->data.buf.end(), resp->header.key.begin());
+            if (keys_.bind(key_id, resp->header.key))
+                resp->header.type = pack::msg_t::ack;
+        }
+
+        if (resp->header.type == pack::msg_t::err)
+            BOOST_LOG_TRIVIAL(error) << "key_bind rejected id=" << key_id << " " << pack->header;
+        reply(resp);
     }
 
-    void start_read_body(pack::packet_pointer pack)
+    // a streamed reply goes out as it comes, unless the peer did not ask
+    // for streams: it then gets it as one frame, if it fits in one
+    template<typename Reply>
+    auto assembling(Reply reply)
     {
-        BOOST_LOG_TRIVIAL(trace) << "start_read_body";
-        auto read_buf = std::make_shared<std::vector<pack::unit_t>>(pack->header.datasize);
-        net::async_read(
-            socket_,
-            net::buffer(read_buf->data(), read_buf->size()),
-            [self=shared_from_this(), read_buf, pack] (boost::system::error_code ec, std::size_t length) {
-                if (not ec)
+        std::shared_ptr<basic::stream_assembler> assembler;
+        if (not streams_)
+            assembler = std::make_shared<basic::stream_assembler>();
+
+        return [assembler, reply] (pack::packet_pointer resp) {
+            bool const streamed = resp->header.type == pack::msg_t::stream or
+                                  resp->header.type == pack::msg_t::chunk;
+            if (not assembler or not streamed)
+            {
+                reply(resp);
+                return;
+            }
+
+            if (resp->header.type == pack::msg_t::stream)
+            {
+                pack::stream_header s;
+                if (not s.parse(resp->data.buf) or not assembler->start(resp->header, s))
                 {
-                    pack->data.parse(length, read_buf->data());
-                    self->start_store(pack);
-                    self->start_read_header();
+                    BOOST_LOG_TRIVIAL(error) << "streamed reply too large for one frame " << resp->header;
+                    pack::packet_pointer err = pack::make_packet();
+                    err->header = resp->header;
+                    err->header.type = pack::msg_t::err;
+                    reply(err);
+                    return;
                 }
-                else
-                    BOOST_LOG_TRIVIAL(error) << "start_read_body: " << ec.message();
-            });
+            }
+            else
+            {
+                if (not assembler->started())
+                    return; // the stream was refused above
+                assembler->add(*resp);
+            }
+
+            if (pack::packet_pointer whole = assembler->take_if_complete())
+                reply(whole);
+        };
+    }
+
+    template<typename Reply>
+    void start_trigger(pack::packet_pointer pack, Reply reply)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "start_trigger";
+        launcher_.start_trigger_post(
+            std::move(pack->data),
+            decompressing(
+                pack,
+                assembling(
+                    [self=shared_from_this(), reply] (pack::packet_pointer resp) {
+                        reply(resp);
+                        if (not self->pipeline_)
+                            self->resume_reading();
+                    })));
+    }
+
+    // body = pack::stream_header of a trigger; its body follows as chunks
+    template<typename Reply>
+    void start_trigger_stream(pack::packet_pointer pack, Reply reply)
+    {
+        pack::stream_header s;
+        if (inbound_stream_ or not s.parse(pack->data.buf) or s.type != pack::msg_t::trigger)
+        {
+            BOOST_LOG_TRIVIAL(error) << "bad stream " << pack->header;
+            pack::packet_pointer resp = pack::make_packet();
+            resp->header = pack->header;
+            resp->header.type = pack::msg_t::err;
+            reply(resp);
+            return;
+        }
+
+        inbound_sink_ = launcher_.start_trigger_stream(s.total, decompressing(pack, assembling(reply)));
+        if (s.total != 0)
+            inbound_stream_ = basic::stream_state{pack->header, s.total};
+        else
+            inbound_sink_.reset();
+    }
+
+    // moves the body of a trigger to its worker through a pipe without
+    // reading it. reading goes on once it is through, without waiting for
+    // the reply. returns false if either side failed
+    auto splice_trigger(pack::packet_pointer pack, boost::system::error_code& ec) -> awaitable<bool>
+    {
+        auto body = std::make_shared<basic::spliced_body>(pack->header.datasize);
+        if (not body->valid())
+            co_return false;
+        SCOPE_DEFER([body] {
+            if (not body->filled())
+                body->abort();
+        });
+
+        launcher_.start_trigger_splice(body, decompressing(pack, assembling(replier())));
+        auto resume = [self=shared_from_this()] { self->resume_reading(); };
+
+        // body bytes that came in with the header
+        while (reader_.size() != 0 and not body->filled())
+        {
+            std::uint64_t const seen = body->consumed();
+            ssize_t const n = body->fill(reader_.data(), reader_.size());
+            if (n > 0)
+                reader_.consume(n);
+            else if (body->wait_for_room(seen, resume))
+                co_await pause_reading();
+            else if (body->aborted())
+                co_return false;
+        }
+
+        int const fd = socket_.native_handle();
+        socket_.native_non_blocking(true, ec);
+        while (not body->filled())
+        {
+            if (body->aborted())
+                co_return false;
+
+            std::uint64_t const seen = body->consumed();
+            ssize_t const n = body->fill_from(fd);
+            if (n > 0)
+                continue;
+            if (n == 0)
+            {
+                ec = net::error::eof;
+                co_return false;
+            }
+            if (errno != EAGAIN and errno != EWOULDBLOCK)
+            {
+                ec.assign(errno, boost::system::system_category());
+                co_return false;
+            }
+
+            if (body->room() == 0 or basic::spliced_body::socket_has_data(fd))
+            {
+                if (body->wait_for_room(seen, resume))
+                    co_await pause_reading();
+                continue;
+            }
+
+            co_await socket_.async_wait(basic::stream_socket::wait_read, net::redirect_error(use_awaitable, ec));
+            if (ec)
+                co_return false;
+        }
+        co_return true;
+    }
+
+    template<typename Reply>
+    void start_batch(pack::packet_pointer pack, Reply reply)
+    {
+        std::vector<pack::packet_pointer> subs;
+        if (not pack::unbatch(*pack, subs))
+        {
+            BOOST_LOG_TRIVIAL(error) << "malformed batch " << pack->header;
+            pack::packet_pointer resp = pack::make_packet();
+            resp->header = pack->header;
+            resp->header.type = pack::msg_t::err;
+            reply(resp);
+            return;
+        }
+
+        // gets answer outside the batch frame, see batch_reply
+        std::size_t const collected = std::count_if(subs.begin(), subs.end(), [] (pack::packet_pointer const& sub) {
+            return sub->header.type != pack::msg_t::get;
+        });
+        auto replies = std::allocate_shared<batch_reply>(pack::recycling_allocator<batch_reply>{},
+                                                         pack->header, collected, reply);
+        for (std::size_t i = 0, slot = 0; i < subs.size(); i++)
+        {
+            pack::packet_pointer sub = subs[i];
+            if (sub->header.type == pack::msg_t::get)
+            {
+                start_load(sub, reply);
+                continue;
+            }
+
+            auto set_reply = [replies, index=slot++] (pack::packet_pointer resp) { replies->set(index, resp); };
+            switch (sub->header.type)
+            {
+            case pack::msg_t::put:
+                start_store(sub, set_reply);
+                break;
+
+            case pack::msg_t::get: // answered above
+                break;
+
+            case pack::msg_t::trigger:
+                launcher_.start_trigger_post(std::move(sub->data), decompressing(sub, set_reply));
+                break;
+
+            case pack::msg_t::err:
+            case pack::msg_t::ack:
+            case pack::msg_t::worker_reg:
+            case pack::msg_t::worker_dereg:
+            case pack::msg_t::worker_push_request:
+            case pack::msg_t::worker_response:
+            case pack::msg_t::batch:
+            case pack::msg_t::stream:
+            case pack::msg_t::chunk:
+            case pack::msg_t::hello:
+            case pack::msg_t::key_bind:
+            {
+                BOOST_LOG_TRIVIAL(error) << "batch packet error " << sub->header;
+                pack::packet_pointer resp = pack::make_packet();
+                resp->header = sub->header;
+                resp->header.type = pack::msg_t::err;
+                set_reply(resp);
+                break;
+            }
+            }
+        }
+        replies->flush_if_empty();
     }
 
-    void start_store(pack::packet_pointer pack)
+    template<typename Reply>
+    void start_store(pack::packet_pointer pack, Reply reply)
     {
         net::post(
             io_context_,
-            [self=shared_from_this(), pack] {
-                bucket& buck = self->get_bucket(pack->header);
-                buck.push_message(pack->data);
-                buck.start_handle_events(pack);
+            basic::recycled([self=shared_from_this(), pack, reply] {
+                std::shared_ptr<bucket> buck = self->get_bucket(pack->header);
+                // the budget and spill limits count only these bytes
+                pack->data.buf = pack->data.buf.compact();
+                std::uint64_t const size = pack->data.buf.size();
+                buck->push_message(queued_message{std::move(pack->data), self->flow_.charge_inbound(size)});
+                buck->start_handle_events(pack);
 
-                pack::packet_pointer resp = std::make_shared<pack::packet>();
+                pack::packet_pointer resp = pack::make_packet();
                 resp->header = pack->header;
                 resp->header.type = pack::msg_t::ack;
-                self->start_write(resp);
-            });
+                reply(resp);
+            }));
     }
 
-    void start_load(pack::packet_pointer pack)
+    template<typename Reply>
+    void start_load(pack::packet_pointer pack, Reply reply)
     {
         BOOST_LOG_TRIVIAL(trace) << "start_load";
         net::post(
             io_context_,
-            [self=shared_from_this(), pack] {
+            basic::recycled([self=shared_from_this(), pack, reply] {
                 BOOST_LOG_TRIVIAL(trace) << "load: register listener";
 
-                self->get_bucket(pack->header).get_connect(
-                    [self=self->shared_from_this()](pack::packet_pointer pack) {
-                        BOOST_LOG_TRIVIAL(trace) << "run signaled wri   te";
-                        self->start_write(pack);
-                    });
+                std::shared_ptr<bucket> buck = self->get_bucket(pack->header);
+                buck->get_connect(
+                    decompressing(
+                        pack,
+                        [reply](pack::packet_pointer pack) {
+                            BOOST_LOG_TRIVIAL(trace) << "run signaled wri   te";
+                            reply(pack);
+                        }));
 
-                self->get_bucket(pack->header).start_handle_events(pack);
-            });
+                buck->start_handle_events(pack);
+            }));
     }
 
-    void start_write(pack::packet_pointer pack)
+    void start_write(pack::packet_pointer pack, int version)
     {
         BOOST_LOG_TRIVIAL(trace) << "write";
-        auto buf_pointer = pack->serialize();
-        net::async_write(
-            socket_,
-            net::buffer(buf_pointer->data(), buf_pointer->size()),
-            net::bind_executor(
-                write_io_strand_,
-                [self=shared_from_this(), buf_pointer] (boost::system::error_code ec, std::size_t /*length*/) {
-                    if (not ec)
-                        BOOST_LOG_TRIVIAL(debug) << "sent msg";
-                }));
+        write_queue_.push(
+            shared_from_this(), pack,
+            [this, version] (pack::packet_header const& h, pack::unit_t* pos) {
+                return (version == 2)?
+                    pack::compact_header::dump(keys_, h, pos):
+                    h.dump(pos);
+            });
     }
 };
 
-class tcp_server
+// accepts on a tcp port or, for clients and workers on this host, on a
+// unix domain socket; either way the peer is served by a tcp_connection
+template<typename Protocol>
+class stream_server
 {
     net::io_context& io_context_;
-    tcp::acceptor acceptor_;
-    topics topics_;
-    launcher::launcher launcher_;
+    typename Protocol::acceptor acceptor_;
+    topics& topics_;
+    launcher::launcher& launcher_;
+    std::size_t const pipeline_depth_;
+    basic::flow_limits const flow_;
+    basic::global_flow& global_flow_;
+    int socket_busy_poll_; // SO_BUSY_POLL of accepted tcp sockets in microseconds, 0 = unset
 
 public:
-    tcp_server(net::io_context& io_context, net::ip::port_type port)
+    // reuse_port lets one tcp acceptor per shard bind the same port;
+    // the kernel then spreads new connections over them
+    stream_server(net::io_context& io_context, typename Protocol::endpoint const& endpoint, bool reuse_port,
+                  topics& t, launcher::launcher& l, std::size_t pipeline_depth,
+                  basic::flow_limits const& flow, basic::global_flow& global, int socket_busy_poll = 0)
         : io_context_(io_context),
-          acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-          launcher_{io_context} {
+          acceptor_(io_context),
+          topics_{t},
+          launcher_{l},
+          pipeline_depth_{pipeline_depth},
+          flow_{flow},
+          global_flow_{global},
+          socket_busy_poll_{socket_busy_poll} {
+        acceptor_.open(endpoint.protocol());
+        if constexpr (std::is_same_v<Protocol, tcp>)
+        {
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            if (reuse_port)
+                acceptor_.set_option(basic::reuse_port(true));
+        }
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
         start_accept();
     }
 
     void start_accept()
     {
         acceptor_.async_accept(
-            [this] (boost::system::error_code const& error, tcp::socket socket) {
+            [this] (boost::system::error_code const& error, typename Protocol::socket socket) {
                 if (not error)
                 {
+                    set_busy_poll(socket);
                     auto accepted = std::make_shared<tcp_connection>(
                         io_context_,
                         topics_,
-                        std::move(socket),
-                        launcher_);
-                    accepted->start_read_header();
+                        basic::stream_socket{std::move(socket)},
+                        launcher_,
+                        pipeline_depth_,
+                        flow_,
+                        global_flow_);
+                    accepted->start_read();
                     start_accept();
                 }
             });
     }
+
+    void set_busy_poll([[maybe_unused]] typename Protocol::socket& socket)
+    {
+#ifdef SO_BUSY_POLL
+        if constexpr (std::is_same_v<Protocol, tcp>)
+            if (socket_busy_poll_ != 0)
+            {
+                boost::system::error_code ec;
+                socket.set_option(basic::socket_busy_poll(socket_busy_poll_), ec);
+                if (ec)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "SO_BUSY_POLL: " << ec.message() << "; not set from now on";
+                    socket_busy_poll_ = 0;
+                }
+            }
+#endif // SO_BUSY_POLL
+    }
 };
 
+using tcp_server = stream_server<tcp>;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+using unix_server = stream_server<net::local::stream_protocol>;
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
 int main(int argc, char* argv[])
 {
     basic::init_log();
@@ -345,7 +1427,39 @@ int main(int argc, char* argv[])
     po::options_description desc{"Options"};
     desc.add_options()
         ("help,h", "Print this help messages")
-        ("listen,l", po::value<unsigned short>()->default_value(12000), "listen on this port");
+        ("listen,l", po::value<unsigned short>()->default_value(12000), "listen on this port")
+        ("unix,u", po::value<std::string>(), "also listen on this unix domain socket path, for clients and workers on this host")
+        ("pipeline-depth,p", po::value<std::size_t>()->default_value(0), "in-flight requests per connection, replied in request order. 0 = reply as completed")
+        ("shards,s", po::value<unsigned int>()->default_value(0), "run N io_contexts with one thread and one SO_REUSEPORT acceptor each. 0 = one io_context shared by all threads")
+        ("inbound-high", po::value<std::uint64_t>()->default_value(0), "stop reading a connection once it has this many body bytes queued in buckets. 0 = no limit")
+        ("inbound-low", po::value<std::uint64_t>()->default_value(0), "resume reading it at this many. 0 = half of high")
+        ("outbound-high", po::value<std::uint64_t>()->default_value(0), "stop reading a connection once this many reply bytes wait to be sent to it. 0 = no limit")
+        ("outbound-low", po::value<std::uint64_t>()->default_value(0), "resume reading it at this many. 0 = half of high")
+        ("global-inbound-high", po::value<std::uint64_t>()->default_value(0), "process-wide --inbound-high; pauses connections that have bytes queued. 0 = no limit")
+        ("global-inbound-low", po::value<std::uint64_t>()->default_value(0), "process-wide --inbound-low")
+        ("global-outbound-high", po::value<std::uint64_t>()->default_value(0), "process-wide --outbound-high; pauses connections that have replies pending. 0 = no limit")
+        ("global-outbound-low", po::value<std::uint64_t>()->default_value(0), "process-wide --outbound-low")
+        ("memfd-min-size", po::value<std::size_t>()->default_value(1 << 20), "pass bodies of at least this many bytes to workers on the unix socket as a memfd, if they ask for it. 0 = never")
+        ("stream-window", po::value<std::uint64_t>()->default_value(8 << 20), "bytes of a streamed body read ahead of its receiver, per connection and per worker")
+        ("max-decompressed-size", po::value<std::uint64_t>()->default_value(64 << 20), "largest body a compressed one may expand to when the proxy decompresses it for a client or worker that takes no compressed bodies; bigger ones fail")
+        ("splice-min-size", po::value<std::uint64_t>()->default_value(0), "move uncompressed trigger bodies of at least this many bytes from the client to the worker socket with splice(), never reading them. linux only. 0 = never")
+        ("busy-poll", po::value<unsigned int>()->default_value(0), "microseconds an io thread spins on poll() after its last handler before it blocks. costs a core per thread. 0 = always block")
+        ("socket-busy-poll", po::value<int>()->default_value(0), "SO_BUSY_POLL in microseconds on accepted tcp sockets. linux only. 0 = unset")
+        ("pin", po::bool_switch(), "pin every io thread to one cpu, round robin over the allowed cpus")
+        ("cpuset", po::value<std::string>(), "run io threads only on these cpus, e.g. 0-7,16-23. without --shards, one thread per cpu")
+        ("numa-node", po::value<int>()->default_value(-1), "run io threads only on the cpus of this numa node; pools then stay on its memory. -1 = any")
+        ("min-threads", po::value<std::size_t>()->default_value(1), "with --max-threads: io threads that keep running while idle")
+        ("max-threads", po::value<std::size_t>()->default_value(0), "without --shards: add io threads up to this many while handlers queue up, and park them again when idle. 0 = a fixed thread per cpu")
+        ("target-queue-delay", po::value<unsigned int>()->default_value(500), "microseconds a handler may wait to run before another io thread is added")
+        ("pool-stats-interval", po::value<unsigned int>()->default_value(10), "with --max-threads: seconds between elastic_pool stats lines. 0 = never")
+        ("bucket-ttl", po::value<unsigned int>()->default_value(0), "seconds an empty bucket may go unused before it is evicted. 0 (default) = keep buckets forever")
+        ("topics-budget", po::value<std::uint64_t>()->default_value(0), "bytes the buckets may take, queued bodies included; least recently used buckets are evicted beyond it. 0 = no limit")
+        ("log-dir", po::value<std::string>(), "keep the messages queued in buckets in an append-only log in this directory, and queue them again on start")
+        ("log-segment-size", po::value<std::size_t>()->default_value(64 << 20), "bytes per log segment file")
+        ("log-commit-interval", po::value<unsigned int>()->default_value(5000), "microseconds the log gathers puts before one sync commits them all; a put is on disk this long after its ack")
+        ("spill-bucket-bytes", po::value<std::uint64_t>()->default_value(0), "body bytes a bucket queues in memory; later messages wait in a spill file until it drains. 0 = no limit")
+        ("spill-total-bytes", po::value<std::uint64_t>()->default_value(0), "body bytes all buckets queue in memory before messages are spilled. 0 = no limit")
+        ("spill-dir", po::value<std::string>(), "directory of the spill files. default: the temp directory");
     po::positional_options_description pos_po;
     po::variables_map vm;
     po::store(po::command_line_parser(argc, argv)
@@ -359,29 +1473,212 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    int const worker = std::thread::hardware_concurrency();
-    //int const worker = 0;
-    net::io_context ioc {worker};
+    // io threads are placed before they touch anything, so the pools and
+    // connections each one allocates first land on its own numa node
+    basic::numa::placement placement;
+    placement.pin = vm["pin"].as<bool>();
+    placement.node = vm["numa-node"].as<int>();
+    bool const restricted = vm.count("cpuset") or placement.node >= 0;
+    if (placement.pin or restricted)
+    {
+        placement.cpus = basic::numa::allowed_cpus();
+        auto keep_only = [&placement] (std::vector<int> const& subset) {
+            std::erase_if(placement.cpus, [&subset] (int cpu) {
+                return not std::binary_search(subset.begin(), subset.end(), cpu);
+            });
+        };
+        if (vm.count("cpuset"))
+            keep_only(basic::numa::parse_cpu_list(vm["cpuset"].as<std::string>()));
+        if (placement.node >= 0)
+            keep_only(basic::numa::node_cpus(placement.node));
+
+        if (placement.cpus.empty())
+        {
+            BOOST_LOG_TRIVIAL(error) << "--pin/--cpuset/--numa-node leave no cpu to run on";
+            return EXIT_FAILURE;
+        }
+    }
+    if (not placement.apply(0))
+        BOOST_LOG_TRIVIAL(error) << "can not set the cpu affinity of io thread 0";
+
+    int const worker = (restricted and placement.enabled())?
+        static_cast<int>(placement.cpus.size()): static_cast<int>(std::thread::hardware_concurrency());
+    unsigned int const shards = vm["shards"].as<unsigned int>();
+    std::size_t const max_threads = (shards == 0)? vm["max-threads"].as<std::size_t>(): 0;
+    if (shards != 0 and vm["max-threads"].as<std::size_t>() != 0)
+        BOOST_LOG_TRIVIAL(error) << "--max-threads is ignored with --shards: every shard has one thread";
+
+    // sharded: connections, their buckets and timers stay on the shard that
+    // accepted them; only work on another shard's bucket hops over.
+    // otherwise: one io_context run by every thread
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    if (shards == 0)
+        contexts.push_back(std::make_unique<net::io_context>((max_threads != 0)? static_cast<int>(max_threads): worker));
+    else
+        for (unsigned int i = 0; i < shards; i++)
+            contexts.push_back(std::make_unique<net::io_context>(1));
+
+    net::io_context& ioc = *contexts.front();
+    std::optional<basic::elastic_pool> pool;
     net::signal_set listener(ioc, SIGINT, SIGTERM);
     listener.async_wait(
-        [&ioc](boost::system::error_code const&, int signal_number) {
+        [&contexts, &pool](boost::system::error_code const&, int signal_number) {
             BOOST_LOG_TRIVIAL(info) << "Stopping... sig=" << signal_number;
-            ioc.stop();
+            if (pool)
+                pool->stop();
+            for (auto& io : contexts)
+                io->stop();
         });
 
     unsigned short const port = vm["listen"].as<unsigned short>();
+    std::size_t const pipeline_depth = vm["pipeline-depth"].as<std::size_t>();
 
-    tcp_server server{ioc, port};
-    BOOST_LOG_TRIVIAL(info) << "listen on " << port;
+    auto watermark_limits = [&vm] (std::string const& name) {
+        basic::limits l {vm[name + "-high"].as<std::uint64_t>(), vm[name + "-low"].as<std::uint64_t>()};
+        if (l.low == 0 or l.low >= l.high)
+            l.low = l.high / 2;
+        return l;
+    };
+    std::uint64_t const stream_window = std::max<std::uint64_t>(vm["stream-window"].as<std::uint64_t>(), basic::stream_piece_size);
+    basic::flow_limits const flow {watermark_limits("inbound"), watermark_limits("outbound"), stream_window};
+    basic::global_flow global_flow {watermark_limits("global-inbound"), watermark_limits("global-outbound")};
+    pack::max_decompressed_size = std::min<std::uint64_t>(vm["max-decompressed-size"].as<std::uint64_t>(),
+                                                          std::numeric_limits<std::uint32_t>::max());
+
+    topics topics_{contexts};
+    basic::spill_limits spill_limits;
+    spill_limits.bucket = vm["spill-bucket-bytes"].as<std::uint64_t>();
+    spill_limits.total = vm["spill-total-bytes"].as<std::uint64_t>();
+    if (spill_limits.enabled())
+    {
+        std::error_code ec;
+        spill_limits.dir = vm.count("spill-dir")? std::filesystem::path{vm["spill-dir"].as<std::string>()}:
+                                                  std::filesystem::temp_directory_path(ec);
+        if (ec or not std::filesystem::is_directory(spill_limits.dir, ec))
+        {
+            BOOST_LOG_TRIVIAL(error) << "no directory for spill files: " << spill_limits.dir;
+            return EXIT_FAILURE;
+        }
+        BOOST_LOG_TRIVIAL(info) << "spill to " << spill_limits.dir << " past " << spill_limits.bucket
+                                << " bytes per bucket, " << spill_limits.total << " in all";
+        topics_.spill(spill_limits);
+    }
+    std::shared_ptr<basic::durable_log> message_log;
+    if (vm.count("log-dir"))
+    {
+        basic::durable_log::settings s;
+        s.dir = vm["log-dir"].as<std::string>();
+        s.segment_size = std::max<std::size_t>(vm["log-segment-size"].as<std::size_t>(), 1 << 20);
+        s.commit_interval = std::chrono::microseconds{vm["log-commit-interval"].as<unsigned int>()};
+        message_log = std::make_shared<basic::durable_log>(s);
+        topics_.persist(message_log);
+        bool const recovered = message_log->recover(
+            [&topics_] (basic::topic_key const& k, std::uint64_t seq, pack::packet_data data) {
+                topics_.restore(k, seq, std::move(data));
+            });
+        if (not recovered)
+        {
+            BOOST_LOG_TRIVIAL(error) << "can not use --log-dir " << s.dir;
+            return EXIT_FAILURE;
+        }
+        message_log->start();
+    }
+    topics_.start_eviction(std::chrono::seconds{vm["bucket-ttl"].as<unsigned int>()},
+                           vm["topics-budget"].as<std::uint64_t>());
+    // one launcher for all shards: a worker registered on any of them serves every key
+    launcher::launcher launcher_{ioc, vm["memfd-min-size"].as<std::size_t>(), stream_window,
+                                 vm["splice-min-size"].as<std::uint64_t>()};
+    if (vm["splice-min-size"].as<std::uint64_t>() != 0 and not basic::spliced_body::supported())
+        BOOST_LOG_TRIVIAL(error) << "--splice-min-size is not supported on this platform";
+
+    std::chrono::microseconds const busy_poll {vm["busy-poll"].as<unsigned int>()};
+    int const socket_busy_poll = vm["socket-busy-poll"].as<int>();
+#ifndef SO_BUSY_POLL
+    if (socket_busy_poll != 0)
+        BOOST_LOG_TRIVIAL(error) << "--socket-busy-poll is not supported on this platform";
+#endif // SO_BUSY_POLL
+
+    std::list<tcp_server> servers;
+    for (auto& io : contexts)
+        servers.emplace_back(*io, tcp::endpoint{tcp::v4(), port}, shards != 0,
+                             topics_, launcher_, pipeline_depth, flow, global_flow, socket_busy_poll);
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    // the unix socket has no SO_REUSEPORT sharding; it is served by the first io_context
+    std::string const unix_path = vm.count("unix")? vm["unix"].as<std::string>(): "";
+    std::optional<unix_server> local_server;
+    if (not unix_path.empty())
+    {
+        if (std::filesystem::is_socket(unix_path))
+            std::filesystem::remove(unix_path); // left over by a previous run
+        local_server.emplace(ioc, net::local::stream_protocol::endpoint{unix_path}, false,
+                             topics_, launcher_, pipeline_depth, flow, global_flow);
+        BOOST_LOG_TRIVIAL(info) << "listen on unix socket " << unix_path;
+    }
+#else
+    if (vm.count("unix"))
+        BOOST_LOG_TRIVIAL(error) << "--unix is not supported on this platform";
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+#ifdef BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+    BOOST_LOG_TRIVIAL(info) << "io backend: io_uring";
+#else
+    BOOST_LOG_TRIVIAL(info) << "io backend: reactor (epoll/kqueue/select)";
+#endif // BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+    BOOST_LOG_TRIVIAL(info) << "listen on " << port << " shards=" << shards << " busy_poll=" << busy_poll.count() << "us";
+    if (placement.enabled())
+        BOOST_LOG_TRIVIAL(info) << "io threads on " << placement.cpus.size() << " cpus, pinned=" << placement.pin
+                                << " numa_node=" << placement.node;
+
+#ifdef PROXY_COUNT_ALLOCS
+    auto alloc_reporter = std::make_shared<basic::alloc_counter::reporter>(ioc, std::chrono::seconds{1});
+    alloc_reporter->start_report();
+#endif // PROXY_COUNT_ALLOCS
+
+    auto run_io = [&placement, busy_poll] (net::io_context& io, std::size_t i) {
+        if (not placement.apply(i))
+            BOOST_LOG_TRIVIAL(error) << "can not set the cpu affinity of io thread " << i;
+        basic::run_busy_polling(io, busy_poll);
+    };
 
     std::vector<std::thread> v;
-    v.reserve(worker);
-    for(int i = 1; i < worker; i++)
-        v.emplace_back([&ioc] { ioc.run(); });
-    ioc.run();
+    if (max_threads != 0)
+    {
+        basic::elastic_pool::settings s;
+        s.min_threads = std::clamp<std::size_t>(vm["min-threads"].as<std::size_t>(), 1, max_threads);
+        s.max_threads = max_threads;
+        s.target_delay = std::chrono::microseconds{vm["target-queue-delay"].as<unsigned int>()};
+        s.measure_utilization = busy_poll.count() == 0;
+        pool.emplace(ioc, s, [&ioc, &run_io] (std::size_t i) { run_io(ioc, i); });
+        pool->start();
+        BOOST_LOG_TRIVIAL(info) << "elastic io threads: " << s.min_threads << " to " << s.max_threads;
+        if (unsigned int const interval = vm["pool-stats-interval"].as<unsigned int>(); interval != 0)
+            std::make_shared<basic::elastic_pool_reporter>(ioc, *pool, std::chrono::seconds{interval})->start_report();
+    }
+    else if (shards == 0)
+    {
+        v.reserve(worker);
+        for(int i = 1; i < worker; i++)
+            v.emplace_back(run_io, std::ref(ioc), i);
+    }
+    else
+    {
+        v.reserve(shards);
+        for (unsigned int i = 1; i < shards; i++)
+            v.emplace_back(run_io, std::ref(*contexts[i]), i);
+    }
+    basic::run_busy_polling(ioc, busy_poll);
 
+    if (pool)
+        pool->join();
     for (std::thread& th : v)
         th.join();
+    if (message_log)
+        message_log->stop();
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (not unix_path.empty())
+        std::filesystem::remove(unix_path);
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
 
     return EXIT_SUCCESS;
 }
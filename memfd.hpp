@@ -0,0 +1,208 @@
+#pragma once
+#ifndef MEMFD_HPP__
+#define MEMFD_HPP__
+
+#include "basic.hpp"
+#include "serializer.hpp"
+
+#include <deque>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif // __linux__
+
+namespace basic
+{
+
+// an anonymous file holding one body, handed to a worker on this host
+// with SCM_RIGHTS instead of being written through the socket: the worker
+// maps it and reads the body in place. the proxy seals what it sends, so
+// the mapping can not shrink or change under the worker.
+class memfd
+{
+    int fd_ = -1;
+
+public:
+    memfd() = default;
+    explicit memfd(int fd): fd_{fd} {}
+    memfd(memfd && other) noexcept: fd_{std::exchange(other.fd_, -1)} {}
+
+    auto operator= (memfd && other) noexcept -> memfd&
+    {
+        if (this != &other)
+        {
+            close();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    ~memfd() { close(); }
+
+    void close()
+    {
+#ifdef __linux__
+        if (fd_ != -1)
+            ::close(std::exchange(fd_, -1));
+#endif // __linux__
+    }
+
+    auto native_handle() const -> int { return fd_; }
+    explicit operator bool() const { return fd_ != -1; }
+
+    static constexpr bool supported()
+    {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // a sealed memfd with a copy of buf; empty if it could not be made
+    static auto copy_of(pack::payload const& buf) -> memfd
+    {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+        memfd m{::memfd_create("proxy-body", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+        if (not m)
+        {
+            BOOST_LOG_TRIVIAL(error) << "memfd_create: " << std::strerror(errno);
+            return {};
+        }
+
+        pack::unit_t const* pos = buf.data();
+        std::size_t left = buf.size();
+        while (left != 0)
+        {
+            ssize_t const n = ::write(m.fd_, pos, left);
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                BOOST_LOG_TRIVIAL(error) << "memfd write: " << std::strerror(errno);
+                return {};
+            }
+            pos += n;
+            left -= n;
+        }
+
+        if (::fcntl(m.fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "memfd seal: " << std::strerror(errno);
+            return {};
+        }
+        return m;
+#else
+        (void) buf;
+        return {};
+#endif
+    }
+
+    // copies the first size bytes into out; false if the file is shorter.
+    // the fd comes from a worker, which may not have sealed it and may
+    // still shrink it: read with pread, as a mapping would fault past the end
+    bool read(std::size_t size, pack::packet_data& out) const
+    {
+#ifdef __linux__
+        pack::unit_t* pos = out.allocate(size);
+        std::uint64_t offset = 0;
+        while (offset != size)
+        {
+            ssize_t const n = ::pread(fd_, pos, size - offset, static_cast<off_t>(offset));
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            pos += n;
+            offset += n;
+        }
+        return true;
+#else
+        (void) size; (void) out;
+        return false;
+#endif // __linux__
+    }
+};
+
+#ifdef __linux__
+
+// sendmsg of [data, data + size) with fd attached to its first byte.
+// never blocks: returns the bytes sent, or -1 with errno set
+inline auto send_with_fd(int socket, void const* data, std::size_t size, int fd) -> ssize_t
+{
+    iovec iov {const_cast<void*>(data), size};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n;
+    do
+        n = ::sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    while (n < 0 and errno == EINTR);
+    return n;
+}
+
+// recvmsg into b; descriptors that came along are appended to fds in
+// the order they were sent. never blocks: returns the bytes read, 0 on
+// eof, or -1 with errno set
+inline auto receive_with_fds(int socket, net::mutable_buffer b, std::deque<memfd>& fds) -> ssize_t
+{
+    constexpr std::size_t max_fds = 8;
+    iovec iov {b.data(), b.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do
+        n = ::recvmsg(socket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    while (n < 0 and errno == EINTR);
+    if (n < 0)
+        return n;
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        std::size_t const count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.emplace_back(fd);
+        }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        errno = EPROTO; // descriptors were dropped; frames and fds no longer line up
+        return -1;
+    }
+    return n;
+}
+
+#endif // __linux__
+
+} // namespace basic
+
+#endif // MEMFD_HPP__
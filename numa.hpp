@@ -0,0 +1,153 @@
+#pragma once
+#ifndef NUMA_HPP__
+#define NUMA_HPP__
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+namespace basic::numa
+{
+
+// nodes beyond this share the depots of node % max_nodes
+constexpr int max_nodes = 8;
+
+// node of the cpu the calling thread was pinned to; 0 for threads that
+// were not. pools keep one depot per node, so blocks freed on one node
+// are not handed to threads on another
+inline auto this_thread_node() -> int&
+{
+    static thread_local int node = 0;
+    return node;
+}
+
+inline auto depot_index() -> std::size_t
+{
+    return static_cast<std::size_t>(this_thread_node()) % max_nodes;
+}
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}; empty if malformed
+inline auto parse_cpu_list(std::string_view list) -> std::vector<int>
+{
+    std::vector<int> cpus;
+    while (not list.empty())
+    {
+        std::size_t const comma = list.find(',');
+        std::string_view range = list.substr(0, comma);
+        list = (comma == std::string_view::npos)? std::string_view{}: list.substr(comma + 1);
+        while (not range.empty() and (range.back() == '\n' or range.back() == ' '))
+            range.remove_suffix(1);
+        if (range.empty())
+            continue;
+
+        int first = 0, last = 0;
+        std::size_t const dash = range.find('-');
+        std::string_view const a = range.substr(0, dash);
+        if (std::from_chars(a.data(), a.data() + a.size(), first).ec != std::errc{})
+            return {};
+        last = first;
+        if (dash != std::string_view::npos)
+        {
+            std::string_view const b = range.substr(dash + 1);
+            if (std::from_chars(b.data(), b.data() + b.size(), last).ec != std::errc{} or last < first)
+                return {};
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+// cpus of a numa node, from sysfs; empty if there is no such node
+inline auto node_cpus(int node) -> std::vector<int>
+{
+    std::ifstream in {"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+    std::string list;
+    std::getline(in, list);
+    return parse_cpu_list(list);
+}
+
+// node a cpu belongs to; 0 if sysfs does not say
+inline auto node_of_cpu(int cpu) -> int
+{
+    for (int node = 0; node < 64; node++)
+    {
+        std::vector<int> const cpus = node_cpus(node);
+        if (std::binary_search(cpus.begin(), cpus.end(), cpu))
+            return node;
+    }
+    return 0;
+}
+
+// cpus this process may run on
+inline auto allowed_cpus() -> std::vector<int>
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+#endif // __linux__
+    return cpus;
+}
+
+// binds the calling thread to cpus and records its node, so that memory
+// it touches first lands on that node. false if the kernel refused
+inline bool pin_this_thread(std::vector<int> const& cpus, int node)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu >= 0 and cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    if (::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0)
+        return false;
+    this_thread_node() = node;
+    return true;
+#else
+    (void) cpus; (void) node;
+    return false;
+#endif // __linux__
+}
+
+// where the io threads run: every thread on one cpu of cpus when pin is
+// set, otherwise all of them on all of cpus
+struct placement
+{
+    std::vector<int> cpus;
+    bool pin = false;
+    int node = -1; // -1 = cpus may span nodes
+
+    bool enabled() const { return not cpus.empty(); }
+
+    // applies the placement of io thread i to the calling thread
+    bool apply(std::size_t i) const
+    {
+        if (not enabled())
+            return true;
+        if (not pin)
+            return pin_this_thread(cpus, std::max(node, 0));
+
+        int const cpu = cpus[i % cpus.size()];
+        return pin_this_thread({cpu}, (node >= 0)? node: node_of_cpu(cpu));
+    }
+};
+
+} // namespace basic::numa
+
+#endif // NUMA_HPP__
@@ -0,0 +1,87 @@
+#pragma once
+#ifndef PIPELINE_HPP__
+#define PIPELINE_HPP__
+
+#include "serializer.hpp"
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace basic
+{
+
+// in-flight requests of one connection. every request opens a slot in
+// read order; replies are released in that order no matter which one
+// completes first. reading pauses once depth slots are open.
+class pipeline
+{
+    struct slot
+    {
+        std::vector<pack::packet_pointer> replies;
+        bool done = false;
+    };
+
+    std::mutex mutex_;
+    std::deque<slot> slots_;
+    std::uint64_t released_ = 0; // index of slots_.front()
+    std::size_t const depth_;
+    bool paused_ = false;
+
+public:
+    pipeline(std::size_t depth): depth_{depth} {}
+
+    auto open() -> std::uint64_t
+    {
+        std::scoped_lock lock{mutex_};
+        slots_.emplace_back();
+        return released_ + slots_.size() - 1;
+    }
+
+    // true if the reader has to stop; complete() tells when to resume
+    bool pause_if_full()
+    {
+        std::scoped_lock lock{mutex_};
+        if (slots_.size() >= depth_)
+            paused_ = true;
+        return paused_;
+    }
+
+    // write(pack::packet_pointer) is called in request order, under the lock.
+    // a request answered more than once (get) keeps its later replies in
+    // its slot, or writes them directly once the slot was released.
+    // returns true if reading was paused and may resume now
+    template<typename Write>
+    bool complete(std::uint64_t index, pack::packet_pointer resp, Write && write)
+    {
+        std::scoped_lock lock{mutex_};
+        if (index < released_)
+        {
+            write(resp);
+            return false;
+        }
+
+        slot& s = slots_.at(index - released_);
+        s.replies.push_back(resp);
+        s.done = true;
+
+        while (not slots_.empty() and slots_.front().done)
+        {
+            for (pack::packet_pointer& r : slots_.front().replies)
+                write(r);
+            slots_.pop_front();
+            released_++;
+        }
+
+        if (paused_ and slots_.size() < depth_)
+        {
+            paused_ = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+} // namespace basic
+
+#endif // PIPELINE_HPP__
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef READ_BUFFER_HPP__
+#define READ_BUFFER_HPP__
+
+#include "basic.hpp"
+#include "serializer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace basic
+{
+
+// inbound bytes of one socket. filled by large read_some calls so that
+// every frame already in the kernel buffer is decoded from one wakeup;
+// only the tail of a partial frame is ever moved back to the front.
+class read_buffer
+{
+    pack::buffer_t buf_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+
+public:
+    static constexpr std::size_t default_capacity = 64 * 1024;
+
+    read_buffer(std::size_t capacity = default_capacity): buf_(capacity) {}
+
+    auto data() const -> pack::unit_t const* { return buf_.data() + begin_; }
+    auto size() const -> std::size_t { return end_ - begin_; }
+
+    void consume(std::size_t n)
+    {
+        begin_ += n;
+        if (begin_ == end_)
+            begin_ = end_ = 0;
+    }
+
+    // moves up to n buffered bytes to dst; returns how many
+    auto take(pack::unit_t* dst, std::size_t n) -> std::size_t
+    {
+        n = std::min(n, size());
+        std::memcpy(dst, data(), n);
+        consume(n);
+        return n;
+    }
+
+    auto prepare() -> net::mutable_buffer
+    {
+        if (begin_ != 0)
+        {
+            std::memmove(buf_.data(), data(), size());
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return net::buffer(buf_.data() + end_, buf_.size() - end_);
+    }
+
+    void commit(std::size_t n) { end_ += n; }
+};
+
+} // namespace basic
+
+#endif // READ_BUFFER_HPP__
@@ -2,6 +2,8 @@
 #ifndef CPP_SERIALIZER_OBJECTPACK_HPP__
 #define CPP_SERIALIZER_OBJECTPACK_HPP__
 
+#include "buffer_pool.hpp"
+
 #include <arpa/inet.h>
 
 //#include <boost/functional/hash.hpp>
@@ -15,6 +17,9 @@
 #include <tuple>
 #include <algorithm>
 #include <random>
+#include <shared_mutex>
+#include <unordered_map>
+#include <limits>
 
 namespace pack
 {
@@ -54,8 +59,28 @@ enum class msg_t: unit_t
     worker_push_request = 10,
     worker_response = 11,
     trigger = 16,
+    stream = 17,
+    chunk = 18,
+    batch = 32,
+    hello = 48,
+    key_bind = 49,
 };
 
+// flags share the type byte on the wire; msg_t only uses the low 6 bits
+namespace flag
+{
+constexpr unit_t compressed = 0x80; // body is a zstd frame. on get/trigger: replies may be compressed too
+constexpr unit_t memfd = 0x40;      // body is in a memfd passed with SCM_RIGHTS, not in the stream. on worker_reg: can take such bodies
+constexpr unit_t mask = 0xC0;
+} // namespace flag
+
+// optional features a peer takes, as bits of the first byte of the
+// worker_reg body and of the second byte of the hello body
+namespace capability
+{
+constexpr unit_t streams = 0x01; // bodies may come as msg_t::stream + msg_t::chunk
+} // namespace capability
+
 template<typename Integer>
 auto hton(Integer i) -> Integer
 {
@@ -96,6 +121,7 @@ struct packet_header
     std::uint32_t datasize; // not in byte form
     std::array<unit_t, 4> sequence{};
     std::array<unit_t, 4> random_salt{};
+    unit_t flags = 0; // not in byte form; packed into |type|
 
     static constexpr int bytesize =
         sizeof(datasize) + sizeof(type) +
@@ -130,11 +156,32 @@ struct packet_header
         gen_sequence();
     }
 
-    void parse(unit_t *pos)
+    bool is_compressed() const { return flags & flag::compressed; }
+    bool in_memfd() const { return flags & flag::memfd; }
+
+    void set_compressed(bool c)
+    {
+        flags = c? (flags | flag::compressed): (flags & ~flag::compressed);
+    }
+
+    auto parse_type(unit_t const *pos) -> unit_t const*
+    {
+        unit_t const raw = *pos;
+        type  = static_cast<msg_t>(raw & ~flag::mask);
+        flags = raw & flag::mask;
+        return pos + sizeof(type);
+    }
+
+    auto dump_type(unit_t *pos) const -> unit_t*
+    {
+        *pos = static_cast<unit_t>(type) | flags;
+        return pos + sizeof(type);
+    }
+
+    void parse(unit_t const *pos)
     {
         // |type|
-        std::memcpy(std::addressof(type), pos, sizeof(type));
-        pos += sizeof(type);
+        pos = parse_type(pos);
 
         // |key|
         std::memcpy(key.data(), pos, key.size());
@@ -153,11 +200,10 @@ struct packet_header
         datasize = ntoh(datasize);
     }
 
-    auto dump(unit_t *pos) -> unit_t*
+    auto dump(unit_t *pos) const -> unit_t*
     {
         // |type|
-        std::memcpy(pos, std::addressof(type), sizeof(type));
-        pos += sizeof(type);
+        pos = dump_type(pos);
 
         // |key|
         std::memcpy(pos, key.data(), key.size());
@@ -177,7 +223,7 @@ struct packet_header
         return pos + sizeof(datasize_copy);
     }
 
-    bool is_trigger() { return random_salt.back() == 0; } // change
+    bool is_trigger() const { return random_salt.back() == 0; } // change
 };
 
 struct packet_header_key_hash
@@ -200,9 +246,170 @@ struct packet_header_key_compare
     }
 };
 
+struct key_hash
+{
+    auto operator() (key_t const& k) const -> std::size_t
+    {
+        std::size_t seed = 0x1b873593;
+        hash_range(seed, k.begin(), k.end());
+        return seed;
+    }
+};
+
+// QUIC style varint: the top 2 bits of the first byte give its length (1, 2, 4 or 8 bytes)
+inline
+auto varint_size(unit_t first) -> int { return 1 << (first >> 6); }
+
+inline
+auto dump_varint(std::uint64_t v, unit_t *pos) -> unit_t*
+{
+    int const size = (v < (1 << 6))?  1:
+                     (v < (1 << 14))? 2:
+                     (v < (1 << 30))? 4: 8;
+    unit_t const prefix = (size == 1)? 0x00: (size == 2)? 0x40: (size == 4)? 0x80: 0xC0;
+
+    for (int i = size - 1; i >= 0; i--, v >>= 8)
+        pos[i] = static_cast<unit_t>(v & 0xFF);
+    pos[0] |= prefix;
+    return pos + size;
+}
+
+inline
+auto parse_varint(unit_t const *pos) -> std::uint64_t
+{
+    int const size = varint_size(pos[0]);
+    std::uint64_t v = pos[0] & 0x3F;
+    for (int i = 1; i < size; i++)
+        v = (v << 8) | pos[i];
+    return v;
+}
+
+// per connection binding of 32 byte keys to 4 byte ids (msg_t::key_bind)
+class key_table
+{
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::uint32_t, key_t> keys_;
+    std::unordered_map<key_t, std::uint32_t, key_hash> ids_;
+
+public:
+    static constexpr std::uint32_t unbound = 0xFFFFFFFF;
+    static constexpr std::size_t max_bindings = 1 << 16;
+
+    bool bind(std::uint32_t id, key_t const& key)
+    {
+        std::unique_lock lock{mutex_};
+        if (id == unbound or (keys_.size() >= max_bindings and not keys_.contains(id)))
+            return false;
+
+        // the old key may have been bound to another id since
+        if (auto it = keys_.find(id); it != keys_.end())
+            if (auto old = ids_.find(it->second); old != ids_.end() and old->second == id)
+                ids_.erase(old);
+        keys_[id] = key;
+        ids_[key] = id;
+        return true;
+    }
+
+    bool find_key(std::uint32_t id, key_t& key) const
+    {
+        std::shared_lock lock{mutex_};
+        auto it = keys_.find(id);
+        if (it == keys_.end())
+            return false;
+        key = it->second;
+        return true;
+    }
+
+    auto find_id(key_t const& key) const -> std::uint32_t
+    {
+        std::shared_lock lock{mutex_};
+        auto it = ids_.find(key);
+        return (it == ids_.end())? unbound: it->second;
+    }
+};
+
+// v2 header, negotiated per connection with msg_t::hello
+// |type|key id|sequence|random_salt|datasize (varint)|
+struct compact_header
+{
+    static constexpr int fixed_bytesize =
+        sizeof(msg_t) + sizeof(std::uint32_t) +
+        std::tuple_size<decltype(packet_header::sequence)>::value +
+        std::tuple_size<decltype(packet_header::random_salt)>::value;
+
+    static constexpr int min_bytesize = fixed_bytesize + 1;
+    static constexpr int max_bytesize = fixed_bytesize + 8;
+
+    // varint bytes still missing after min_bytesize bytes were read
+    static auto remaining_bytesize(unit_t const *pos) -> int
+    {
+        return varint_size(pos[fixed_bytesize]) - 1;
+    }
+
+    enum class status { bound, unbound, bad_size };
+
+    // unbound if key_id is not bound; every other field is filled anyway.
+    // bad_size if datasize does not fit the 32 bits of packet_header, in
+    // which case the body can not be told from the next frame
+    static auto parse(key_table const& keys, packet_header& h, std::uint32_t& key_id, unit_t const *pos) -> status
+    {
+        // |type|
+        pos = h.parse_type(pos);
+
+        // |key id|
+        std::memcpy(std::addressof(key_id), pos, sizeof(key_id));
+        key_id = ntoh(key_id);
+        pos += sizeof(key_id);
+
+        // |sequence|
+        std::memcpy(h.sequence.data(), pos, h.sequence.size());
+        pos += h.sequence.size();
+
+        // |random_salt|
+        std::memcpy(h.random_salt.data(), pos, h.random_salt.size());
+        pos += h.random_salt.size();
+
+        // |datasize|
+        std::uint64_t const datasize = parse_varint(pos);
+        if (datasize > std::numeric_limits<std::uint32_t>::max())
+            return status::bad_size;
+        h.datasize = static_cast<std::uint32_t>(datasize);
+
+        h.key = key_t{};
+        return keys.find_key(key_id, h.key)? status::bound: status::unbound;
+    }
+
+    static auto dump(key_table const& keys, packet_header const& h, unit_t *pos) -> unit_t*
+    {
+        // |type|
+        pos = h.dump_type(pos);
+
+        // |key id|
+        std::uint32_t const key_id = hton(keys.find_id(h.key));
+        std::memcpy(pos, std::addressof(key_id), sizeof(key_id));
+        pos += sizeof(key_id);
+
+        // |sequence|
+        std::memcpy(pos, h.sequence.data(), h.sequence.size());
+        pos += h.sequence.size();
+
+        // |random_salt|
+        std::memcpy(pos, h.random_salt.data(), h.random_salt.size());
+        pos += h.random_salt.size();
+
+        // |datasize|
+        return dump_varint(h.datasize, pos);
+    }
+};
+
+static_assert(compact_header::max_bytesize <= packet_header::bytesize);
+
 auto operator <<(std::ostream &os, packet_header const& pd) -> std::ostream&
 {
-    os << "[t=" << static_cast<int>(pd.type) << "|k=";
+    os << "[t=" << static_cast<int>(pd.type);
+    if (pd.flags)
+        os << "+" << std::hex << static_cast<int>(pd.flags);
+    os << "|k=";
     for (key_t::value_type v: pd.key)
         os << std::hex << static_cast<int>(v);
     os << ",seq=";
@@ -215,17 +422,104 @@ auto operator <<(std::ostream &os, packet_header const& pd) -> std::ostream&
     return os;
 }
 
+using buffer_t = buffer<unit_t>;
+
+// bytes of a body: a slice of a pooled buffer that is shared by
+// reference count and never changes once anyone else holds it. copying
+// a payload or cutting a slice out of it shares the buffer, so one body
+// can wait in a bucket, go to every waiting get and sit in several
+// write queues at once. the buffer goes back to the pool with its last slice
+class payload
+{
+    struct block
+    {
+        buffer_t buf;
+        ~block() { buffer_pool<unit_t>::release(std::move(buf)); }
+    };
+
+    std::shared_ptr<block> block_;
+    unit_t const* data_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    using value_type = unit_t;
+    using const_iterator = unit_t const*;
+
+    payload() = default;
+
+    // size bytes to be filled through the returned pointer before the
+    // payload is shared
+    static auto allocate(std::size_t size, unit_t*& out) -> payload
+    {
+        payload p;
+        out = nullptr;
+        if (size == 0)
+            return p;
+        p.block_ = std::allocate_shared<block>(recycling_allocator<block>{});
+        p.block_->buf = buffer_pool<unit_t>::acquire(size);
+        out = p.block_->buf.data();
+        p.data_ = out;
+        p.size_ = size;
+        return p;
+    }
+
+    // [offset, offset + size) of this payload, sharing its buffer
+    auto slice(std::size_t offset, std::size_t size) const -> payload
+    {
+        payload p;
+        if (size == 0)
+            return p;
+        p.block_ = block_;
+        p.data_ = data_ + offset;
+        p.size_ = size;
+        return p;
+    }
+
+    // drops all but the first size bytes
+    void truncate(std::size_t size) { size_ = std::min(size_, size); }
+
+    // this payload, or a copy in a buffer of its own if it leaves more than
+    // an eighth of its size of the buffer unused: what is kept for long,
+    // like one message of a batch waiting in a bucket, must not pin the rest
+    auto compact() const -> payload
+    {
+        if (block_ == nullptr or block_->buf.size() - size_ <= size_ / 8)
+            return *this;
+        unit_t* pos;
+        payload p = allocate(size_, pos);
+        std::memcpy(pos, data_, size_);
+        return p;
+    }
+
+    auto data() const -> unit_t const* { return data_; }
+    auto size() const -> std::size_t { return size_; }
+    bool empty() const { return size_ == 0; }
+    auto begin() const -> const_iterator { return data_; }
+    auto end() const -> const_iterator { return data_ + size_; }
+    auto front() const -> unit_t { return data_[0]; }
+    auto operator[] (std::size_t i) const -> unit_t { return data_[i]; }
+};
+
 struct packet_data
 {
-    std::vector<unit_t> buf;
+    payload buf;
+    bool compressed = false; // buf holds a zstd frame
 
-    void parse(std::uint32_t const& size, unit_t *pos)
+    // a pooled buffer of size bytes, so a socket read can fill it in place
+    // through the returned pointer
+    auto allocate(std::uint32_t const& size) -> unit_t*
     {
-        buf.resize(size);
-        std::memcpy(buf.data(), pos, size);
+        unit_t* pos;
+        buf = payload::allocate(size, pos);
+        return pos;
     }
 
-    auto dump(unit_t *pos) -> unit_t*
+    void parse(std::uint32_t const& size, unit_t const *pos)
+    {
+        std::memcpy(allocate(size), pos, size);
+    }
+
+    auto dump(unit_t *pos) const -> unit_t*
     {
         std::memcpy(pos, buf.data(), buf.size());
         return pos + buf.size();
@@ -238,9 +532,37 @@ struct packet
     packet_header header;
     packet_data data;
 
+    using header_buffer = std::array<unit_t, packet_header::bytesize>;
+
+    // header fields that describe the body
+    void prepare_header()
+    {
+        header = wire_header();
+    }
+
+    // the header with the fields that describe the body filled in. the
+    // packet is left alone: a reply may be shared by several writers
+    auto wire_header() const -> packet_header
+    {
+        packet_header h = header;
+        h.datasize = data.buf.size();
+        h.set_compressed(data.compressed);
+        return h;
+    }
+
+    // only dumps the header; the body is sent straight from data.buf
+    // as the second buffer of a gather write, so it is never copied
+    auto serialize_header() -> header_buffer
+    {
+        prepare_header();
+        header_buffer r;
+        header.dump(r.data());
+        return r;
+    }
+
     auto serialize() -> std::shared_ptr<std::vector<unit_t>>
     {
-        header.datasize = data.buf.size();
+        prepare_header();
         auto r = std::make_shared<std::vector<unit_t>>(packet_header::bytesize + header.datasize);
 
         unit_t* pos = header.dump(r->data());
@@ -252,6 +574,96 @@ struct packet
 
 using packet_pointer = std::shared_ptr<packet>;
 
+// body of msg_t::stream = |type|total|. the body of a |type| frame then
+// follows as msg_t::chunk frames with the same key and salt, until total
+// bytes were sent. total is 64 bit, so a streamed body is not bound by datasize
+struct stream_header
+{
+    msg_t type;
+    std::uint64_t total;
+
+    static constexpr std::size_t bytesize = sizeof(msg_t) + sizeof(std::uint64_t);
+
+    // false if buf is not a stream header
+    bool parse(payload const& buf)
+    {
+        if (buf.size() != bytesize)
+            return false;
+        type = static_cast<msg_t>(buf.front() & ~flag::mask);
+        total = 0;
+        for (std::size_t i = 1; i < bytesize; i++)
+            total = (total << 8) | buf[i];
+        return true;
+    }
+
+    void dump(packet_data& data) const
+    {
+        unit_t* pos = data.allocate(bytesize);
+        pos[0] = static_cast<unit_t>(type);
+        std::uint64_t v = total;
+        for (std::size_t i = bytesize - 1; i >= 1; i--, v >>= 8)
+            pos[i] = static_cast<unit_t>(v & 0xFF);
+    }
+};
+
+// packet and its control block in one recycled block
+inline
+auto make_packet() -> packet_pointer
+{
+    return std::allocate_shared<packet>(recycling_allocator<packet>{});
+}
+
+// batch body = |header|data|header|data|...
+// every sub packet is laid out exactly like a standalone frame
+auto make_batch(packet_header const& h, std::vector<packet_pointer> const& subs) -> packet_pointer
+{
+    std::size_t size = 0;
+    for (packet_pointer const& sub : subs)
+        size += packet_header::bytesize + sub->data.buf.size();
+
+    packet_pointer batch = make_packet();
+    batch->header = h;
+    batch->header.type = msg_t::batch;
+
+    unit_t* pos = batch->data.allocate(size);
+    for (packet_pointer const& sub : subs)
+    {
+        pos = sub->wire_header().dump(pos);
+        pos = sub->data.dump(pos);
+    }
+    return batch;
+}
+
+// returns false if the body is truncated, nests another batch or a
+// stream, or claims a memfd body. sub packet bodies are slices of the
+// batch body, not copies; a bucket keeps them compact()ed
+bool unbatch(packet const& batch, std::vector<packet_pointer>& subs)
+{
+    unit_t const* pos = batch.data.buf.data();
+    unit_t const* const end = pos + batch.data.buf.size();
+
+    while (pos != end)
+    {
+        if (end - pos < packet_header::bytesize)
+            return false;
+
+        packet_pointer sub = make_packet();
+        sub->header.parse(pos);
+        pos += packet_header::bytesize;
+
+        if (sub->header.type == msg_t::batch or sub->header.type == msg_t::stream or
+            sub->header.type == msg_t::chunk or sub->header.in_memfd() or
+            static_cast<std::size_t>(end - pos) < sub->header.datasize)
+            return false;
+
+        sub->data.buf = batch.data.buf.slice(pos - batch.data.buf.data(), sub->header.datasize);
+        sub->data.compressed = sub->header.is_compressed();
+        pos += sub->header.datasize;
+        subs.push_back(sub);
+    }
+    return true;
+}
+
 } // namespace pack
 
 #endif // CPP_SERIALIZER_OBJECTPACK_HPP__
@@ -80,8 +80,7 @@ void readtest (int const times, int const bufsize, std::function<int(int)> genpo
         r.size = buf.size();
         r.to_network_format();
 
-        ptr->data.buf.resize(sizeof (r));
-        std::memcpy(ptr->data.buf.data(), &r, sizeof (r));
+        std::memcpy(ptr->data.allocate(sizeof (r)), &r, sizeof (r));
 
         //std::copy(payload.begin(), payload.end(), std::back_inserter(ptr->data.buf));
 
@@ -137,9 +136,9 @@ void writetest (int const times, int const bufsize, std::function<int(int)> genp
 
         r.to_network_format();
 
-        ptr->data.buf.resize(sizeof (r) + buf.size());
-        std::memcpy(ptr->data.buf.data(), &r, sizeof (r));
-        std::memcpy(ptr->data.buf.data() + sizeof (r), buf.data(), buf.size());
+        pack::unit_t* const body = ptr->data.allocate(sizeof (r) + buf.size());
+        std::memcpy(body, &r, sizeof (r));
+        std::memcpy(body + sizeof (r), buf.data(), buf.size());
 
         //= std::string("{\"operation\": \"write\", \"filename\": \"/helloworld.txt\", \"type\": \"file\", \"position\": 0, \"size\": ") + buf.size() + ", \"data\": \"" + buf + "\"}";
         //std::copy(payload.begin(), payload.end(), std::back_inserter(ptr->data.buf));
@@ -0,0 +1,213 @@
+#pragma once
+#ifndef SPILL_HPP__
+#define SPILL_HPP__
+
+#include "basic.hpp"
+#include "serializer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace basic
+{
+
+// when buckets move what they queue to spill files: past bucket bytes in
+// one bucket or total bytes in all of them. 0 = no such limit
+struct spill_limits
+{
+    std::filesystem::path dir;
+    std::uint64_t bucket = 0;
+    std::uint64_t total = 0;
+
+    bool enabled() const { return bucket != 0 or total != 0; }
+
+    // spilled bytes read back for gets ahead of sending them
+    auto read_back() const -> std::uint64_t { return (bucket != 0)? bucket: total; }
+};
+
+// the messages of one bucket that did not fit in memory, oldest first, in
+// a file nobody else sees: appended at the end, read back from the front.
+// it only lives as long as the process; the durable log is what survives
+// a restart. not thread safe
+class spill_file
+{
+    struct record
+    {
+        std::uint64_t seq;
+        std::uint32_t size;
+        std::uint8_t compressed;
+        std::uint8_t reserved[3];
+    };
+
+    std::filesystem::path const dir_;
+    int fd_ = -1;
+    std::uint64_t read_ = 0;
+    std::uint64_t write_ = 0;
+    std::uint64_t punched_ = 0;
+    std::size_t count_ = 0;
+    std::uint64_t bytes_ = 0;
+
+    // read bytes given back to the file system at a time, while a bucket
+    // that never quite catches up keeps its file open
+    static constexpr std::uint64_t punch_step = 64 << 20;
+
+    static bool pread_all(int fd, void* buf, std::size_t size, std::uint64_t offset)
+    {
+        auto* pos = static_cast<char*>(buf);
+        while (size != 0)
+        {
+            ssize_t const n = ::pread(fd, pos, size, static_cast<off_t>(offset));
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            pos += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // the file, unlinked from the start so nothing is left behind
+    bool open()
+    {
+#ifdef O_TMPFILE
+        fd_ = ::open(dir_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd_ != -1)
+            return true;
+#endif // O_TMPFILE
+        std::string path = (dir_ / "proxy-spill-XXXXXX").string();
+        fd_ = ::mkstemp(path.data());
+        if (fd_ == -1)
+        {
+            BOOST_LOG_TRIVIAL(error) << "spill open in " << dir_ << ": " << std::strerror(errno);
+            return false;
+        }
+        ::unlink(path.c_str());
+        ::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+        return true;
+    }
+
+public:
+    explicit spill_file(std::filesystem::path dir): dir_{std::move(dir)} {}
+    spill_file(spill_file const&) = delete;
+    auto operator= (spill_file const&) -> spill_file& = delete;
+    ~spill_file() { close(); }
+
+    void close()
+    {
+        if (fd_ != -1)
+            ::close(std::exchange(fd_, -1));
+        read_ = write_ = punched_ = bytes_ = 0;
+        count_ = 0;
+    }
+
+    bool empty() const { return count_ == 0; }
+    auto size() const -> std::size_t { return count_; }
+    auto bytes() const -> std::uint64_t { return bytes_; }
+
+    // appends a message; false if it could not be written
+    bool push(pack::packet_data const& data, std::uint64_t seq)
+    {
+        if (fd_ == -1 and not open())
+            return false;
+
+        record r{};
+        r.seq = seq;
+        r.size = static_cast<std::uint32_t>(data.buf.size());
+        r.compressed = data.compressed;
+        iovec iov[2] = {
+            {&r, sizeof(r)},
+            {const_cast<pack::unit_t*>(data.buf.data()), data.buf.size()},
+        };
+
+        std::size_t const total = sizeof(r) + data.buf.size();
+        std::size_t done = 0;
+        while (done != total)
+        {
+            ssize_t const n = ::pwritev(fd_, iov, 2, static_cast<off_t>(write_ + done));
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                BOOST_LOG_TRIVIAL(error) << "spill write: " << std::strerror(errno);
+                return false;
+            }
+            done += n;
+            // skip what was written in the iovecs
+            std::size_t skip = n;
+            for (iovec& v : iov)
+            {
+                std::size_t const s = std::min(skip, v.iov_len);
+                v.iov_base = static_cast<char*>(v.iov_base) + s;
+                v.iov_len -= s;
+                skip -= s;
+            }
+        }
+
+        write_ += total;
+        count_++;
+        bytes_ += data.buf.size();
+        return true;
+    }
+
+    // takes the oldest message; false if there is none or it can not be read
+    bool pop(pack::packet_data& data, std::uint64_t& seq)
+    {
+        record r;
+        if (empty() or not pread_all(fd_, &r, sizeof(r), read_))
+            return false;
+        pack::unit_t* const body = data.allocate(r.size);
+        if (r.size != 0 and not pread_all(fd_, body, r.size, read_ + sizeof(r)))
+        {
+            BOOST_LOG_TRIVIAL(error) << "spill read: " << std::strerror(errno);
+            return false;
+        }
+        data.compressed = r.compressed;
+        seq = r.seq;
+
+        read_ += sizeof(r) + r.size;
+        count_--;
+        bytes_ -= r.size;
+        // drained: the file goes, and with it the disk space
+        if (count_ == 0)
+            close();
+#ifdef FALLOC_FL_PUNCH_HOLE
+        else if (read_ - punched_ >= punch_step)
+        {
+            std::uint64_t const end = read_ / 4096 * 4096;
+            // best effort: not every file system can punch holes
+            ::fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(end));
+            punched_ = end;
+        }
+#endif // FALLOC_FL_PUNCH_HOLE
+        return true;
+    }
+
+    // f(seq) for every message left, without reading the bodies
+    template<typename Function>
+    void for_each_seq(Function && f) const
+    {
+        std::uint64_t offset = read_;
+        for (std::size_t i = 0; i < count_; i++)
+        {
+            record r;
+            if (not pread_all(fd_, &r, sizeof(r), offset))
+                return;
+            f(r.seq);
+            offset += sizeof(r) + r.size;
+        }
+    }
+};
+
+} // namespace basic
+
+#endif // SPILL_HPP__
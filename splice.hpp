@@ -0,0 +1,221 @@
+#pragma once
+#ifndef SPLICE_HPP__
+#define SPLICE_HPP__
+
+#include "basic.hpp"
+#include "handler_memory.hpp"
+#include "serializer.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif // __linux__
+
+namespace basic
+{
+
+// a body moved from one socket to another through a pipe with splice(),
+// so its bytes never enter user space. the reader of the sender fills the
+// pipe, the write queue of the receiver drains it; each one waits for
+// the other while the pipe is full or empty
+class spliced_body
+{
+    int pipe_[2] = {-1, -1};
+    std::uint64_t const size_;
+    std::size_t capacity_ = 0;
+
+    std::mutex mutex_;
+    std::uint64_t produced_ = 0;
+    std::uint64_t consumed_ = 0;
+    bool aborted_ = false;
+    callback<void ()> on_data_;
+    callback<void ()> on_room_;
+
+    // the waiter of the other side, taken out under mutex_
+    static void wake(callback<void ()> f)
+    {
+        if (f)
+            f();
+    }
+
+public:
+    static constexpr std::size_t pipe_size = 1 << 20;
+
+    explicit spliced_body(std::uint64_t size): size_{size}
+    {
+#ifdef __linux__
+        if (::pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+            BOOST_LOG_TRIVIAL(error) << "pipe2: " << std::strerror(errno);
+            pipe_[0] = pipe_[1] = -1;
+            return;
+        }
+        ::fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(pipe_size)); // capped by fs.pipe-max-size
+        int const capacity = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+        capacity_ = (capacity > 0)? capacity: 4096;
+#endif // __linux__
+    }
+
+    spliced_body(spliced_body const&) = delete;
+    auto operator= (spliced_body const&) -> spliced_body& = delete;
+
+    ~spliced_body()
+    {
+#ifdef __linux__
+        for (int fd : pipe_)
+            if (fd != -1)
+                ::close(fd);
+#endif // __linux__
+    }
+
+    static constexpr bool supported()
+    {
+#ifdef __linux__
+        return true;
+#else
+        return false;
+#endif // __linux__
+    }
+
+    bool valid() const { return pipe_[0] != -1; }
+    auto size() const -> std::uint64_t { return size_; }
+
+    auto produced() -> std::uint64_t { std::scoped_lock lock{mutex_}; return produced_; }
+    auto consumed() -> std::uint64_t { std::scoped_lock lock{mutex_}; return consumed_; }
+    bool filled()   { std::scoped_lock lock{mutex_}; return produced_ == size_; }
+    bool drained()  { std::scoped_lock lock{mutex_}; return consumed_ == size_; }
+    bool aborted()  { std::scoped_lock lock{mutex_}; return aborted_; }
+    auto buffered() -> std::uint64_t { std::scoped_lock lock{mutex_}; return produced_ - consumed_; }
+
+    // bytes that may still go into the pipe
+    auto room() -> std::uint64_t
+    {
+        std::scoped_lock lock{mutex_};
+        std::uint64_t const in_pipe = produced_ - consumed_;
+        return std::min<std::uint64_t>(size_ - produced_, (in_pipe < capacity_)? capacity_ - in_pipe: 0);
+    }
+
+    // either side gave up; the other one stops waiting
+    void abort()
+    {
+        callback<void ()> data, room;
+        {
+            std::scoped_lock lock{mutex_};
+            aborted_ = true;
+            data = std::move(on_data_);
+            room = std::move(on_room_);
+        }
+        wake(std::move(data));
+        wake(std::move(room));
+    }
+
+    // true if nothing was drained since consumed() returned seen;
+    // f then runs once something is, or on abort
+    template<typename Function>
+    bool wait_for_room(std::uint64_t seen, Function && f)
+    {
+        std::scoped_lock lock{mutex_};
+        if (aborted_ or consumed_ != seen)
+            return false;
+        on_room_ = std::forward<Function>(f);
+        return true;
+    }
+
+    // true if nothing was added since produced() returned seen;
+    // f then runs once something is, or on abort
+    template<typename Function>
+    bool wait_for_data(std::uint64_t seen, Function && f)
+    {
+        std::scoped_lock lock{mutex_};
+        if (aborted_ or produced_ != seen)
+            return false;
+        on_data_ = std::forward<Function>(f);
+        return true;
+    }
+
+#ifdef __linux__
+    // body bytes the reader had already buffered. returns what fit,
+    // or -1 with EAGAIN if the pipe is full
+    auto fill(pack::unit_t const* data, std::size_t size) -> ssize_t
+    {
+        std::size_t const len = std::min<std::uint64_t>(size, room());
+        if (len == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        return produce(::write(pipe_[1], data, len));
+    }
+
+    // splices from the sender's socket. -1 with EAGAIN if the socket had
+    // nothing or the pipe is full: room() or, when the pipe has no slot
+    // left for partly filled pages, socket_has_data() tells which
+    auto fill_from(int socket) -> ssize_t
+    {
+        std::size_t const len = std::min<std::uint64_t>(room(), pipe_size);
+        if (len == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        return produce(::splice(socket, nullptr, pipe_[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+    }
+
+    static bool socket_has_data(int socket)
+    {
+        int available = 0;
+        return ::ioctl(socket, FIONREAD, &available) == 0 and available > 0;
+    }
+
+    // splices into the receiver's socket. -1 with EAGAIN if the pipe is
+    // empty (buffered() == 0) or the socket can not take more
+    auto drain_to(int socket) -> ssize_t
+    {
+        std::uint64_t const available = buffered();
+        if (available == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        ssize_t const n = ::splice(pipe_[0], nullptr, socket, nullptr, std::min<std::uint64_t>(available, pipe_size),
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (n <= 0)
+            return n;
+
+        callback<void ()> room;
+        {
+            std::scoped_lock lock{mutex_};
+            consumed_ += n;
+            room = std::move(on_room_);
+        }
+        wake(std::move(room));
+        return n;
+    }
+#endif // __linux__
+
+private:
+    auto produce(ssize_t n) -> ssize_t
+    {
+        if (n <= 0)
+            return n;
+
+        callback<void ()> data;
+        {
+            std::scoped_lock lock{mutex_};
+            produced_ += n;
+            data = std::move(on_data_);
+        }
+        wake(std::move(data));
+        return n;
+    }
+};
+
+} // namespace basic
+
+#endif // SPLICE_HPP__
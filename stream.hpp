@@ -0,0 +1,92 @@
+#pragma once
+#ifndef STREAM_HPP__
+#define STREAM_HPP__
+
+#include "flow_control.hpp"
+#include "serializer.hpp"
+
+#include <limits>
+#include <memory>
+
+namespace basic
+{
+
+// streamed bodies are forwarded in pieces of at most this many bytes,
+// whatever chunk sizes the sender picked
+constexpr std::size_t stream_piece_size = 256 * 1024;
+
+// a packet that holds c until the last reference to it is gone, wherever
+// it waits on its way out: pipeline slot, write queue or a worker not chosen yet
+inline
+auto make_charged_packet(charge c) -> pack::packet_pointer
+{
+    struct charged
+    {
+        pack::packet pack;
+        basic::charge charge;
+    };
+
+    auto holder = std::allocate_shared<charged>(pack::recycling_allocator<charged>{});
+    holder->charge = std::move(c);
+    return pack::packet_pointer{holder, &holder->pack};
+}
+
+// the streamed body a socket is receiving; one at a time per socket
+struct stream_state
+{
+    pack::packet_header header;
+    std::uint64_t remaining = 0;
+
+    // true if chunk continues this stream
+    bool continued_by(pack::packet_header const& chunk) const
+    {
+        return chunk.type == pack::msg_t::chunk and
+               pack::packet_header_key_compare{}(header, chunk) and
+               chunk.datasize <= remaining;
+    }
+};
+
+// turns a streamed body back into one frame, for a peer that does not
+// take streams. only bodies that fit in datasize can be assembled
+class stream_assembler
+{
+    pack::packet_pointer pack_;
+    pack::unit_t* body_ = nullptr; // pack_ is not shared until it is complete
+    std::uint64_t filled_ = 0;
+
+public:
+    // false if the body is too large for one frame
+    bool start(pack::packet_header const& h, pack::stream_header const& s)
+    {
+        if (s.total > std::numeric_limits<std::uint32_t>::max())
+            return false;
+
+        pack_ = pack::make_packet();
+        pack_->header = h;
+        pack_->header.type = s.type;
+        body_ = pack_->data.allocate(s.total);
+        filled_ = 0;
+        return true;
+    }
+
+    void add(pack::packet const& chunk)
+    {
+        std::uint64_t const size = std::min<std::uint64_t>(chunk.data.buf.size(), pack_->data.buf.size() - filled_);
+        std::copy_n(chunk.data.buf.begin(), size, body_ + filled_);
+        filled_ += size;
+    }
+
+    // the assembled packet once all of the body is in, nullptr before
+    auto take_if_complete() -> pack::packet_pointer
+    {
+        if (pack_ and filled_ == pack_->data.buf.size())
+            return std::move(pack_);
+        return nullptr;
+    }
+
+    bool started() const { return pack_ != nullptr; }
+};
+
+} // namespace basic
+
+#endif // STREAM_HPP__
@@ -0,0 +1,339 @@
+#pragma once
+#ifndef TOPIC_TABLE_HPP__
+#define TOPIC_TABLE_HPP__
+
+#include "serializer.hpp"
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+namespace basic
+{
+
+// key and salt of a packet_header, the identity of a topic. the key is
+// a sha-256, so a few multiplies mix it well enough to index with
+struct topic_key
+{
+    alignas(16) pack::key_t key;
+    std::uint32_t salt;
+
+    static auto of(pack::packet_header const& h) -> topic_key
+    {
+        topic_key k;
+        k.key = h.key;
+        std::memcpy(&k.salt, h.random_salt.data(), sizeof(k.salt));
+        return k;
+    }
+
+    auto hash() const -> std::uint64_t
+    {
+        std::uint64_t w[4];
+        std::memcpy(w, key.data(), sizeof(w));
+        std::uint64_t h = (w[0] ^ std::rotl(w[1], 17) ^ std::rotl(w[2], 31) ^ std::rotl(w[3], 47))
+                          + salt * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+        h *= 0xd6e8feb86659fd93ULL;
+        h ^= h >> 32;
+        return h;
+    }
+
+    bool operator== (topic_key const& other) const
+    {
+#ifdef __SSE2__
+        __m128i const a0 = _mm_load_si128(reinterpret_cast<__m128i const*>(key.data()));
+        __m128i const a1 = _mm_load_si128(reinterpret_cast<__m128i const*>(key.data() + 16));
+        __m128i const b0 = _mm_load_si128(reinterpret_cast<__m128i const*>(other.key.data()));
+        __m128i const b1 = _mm_load_si128(reinterpret_cast<__m128i const*>(other.key.data() + 16));
+        __m128i const eq = _mm_and_si128(_mm_cmpeq_epi8(a0, b0), _mm_cmpeq_epi8(a1, b1));
+        return _mm_movemask_epi8(eq) == 0xFFFF and salt == other.salt;
+#else
+        return key == other.key and salt == other.salt;
+#endif // __SSE2__
+    }
+};
+
+static_assert(sizeof(pack::key_t) == 32);
+
+// open addressing table keyed by topic_key, swiss table style: a control
+// byte per slot holds 7 bits of the hash, or empty / deleted, and probing
+// looks at 16 of them at once. not thread safe; topic_table shards it
+template<typename Value>
+class flat_topic_map
+{
+    static constexpr std::size_t group = 16;
+    static constexpr std::int8_t empty = -128;  // 0b10000000
+    static constexpr std::int8_t deleted = -2;  // 0b11111110
+
+    struct slot
+    {
+        topic_key key;
+        Value value;
+    };
+
+    std::unique_ptr<std::int8_t[]> ctrl_;
+    std::unique_ptr<slot[]> slots_;
+    std::size_t capacity_ = 0; // slots, a power of 2 and a multiple of group
+    std::size_t size_ = 0;
+    std::size_t deleted_ = 0;
+
+    static auto tag(std::uint64_t h) -> std::int8_t { return static_cast<std::int8_t>(h >> 57); }
+
+    // bit i set if ctrl[i] == c, for the group starting at ctrl
+    static auto match(std::int8_t const* ctrl, std::int8_t c) -> std::uint32_t
+    {
+#ifdef __SSE2__
+        __m128i const g = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ctrl));
+        return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c))));
+#else
+        std::uint32_t mask = 0;
+        for (std::size_t i = 0; i < group; i++)
+            mask |= std::uint32_t{ctrl[i] == c} << i;
+        return mask;
+#endif // __SSE2__
+    }
+
+    // bit i set if ctrl[i] is empty or deleted: both have the sign bit set, a tag does not
+    static auto match_free(std::int8_t const* ctrl) -> std::uint32_t
+    {
+#ifdef __SSE2__
+        __m128i const g = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ctrl));
+        return static_cast<std::uint32_t>(_mm_movemask_epi8(g));
+#else
+        std::uint32_t mask = 0;
+        for (std::size_t i = 0; i < group; i++)
+            mask |= std::uint32_t{ctrl[i] < 0} << i;
+        return mask;
+#endif // __SSE2__
+    }
+
+    // slot of k, or capacity_ if absent
+    auto find_index(topic_key const& k, std::uint64_t h) const -> std::size_t
+    {
+        if (capacity_ == 0)
+            return capacity_;
+
+        std::size_t const groups_mask = capacity_ / group - 1;
+        std::size_t g = (h & groups_mask);
+        std::int8_t const t = tag(h);
+        for (std::size_t step = 1; ; step++)
+        {
+            std::int8_t const* ctrl = ctrl_.get() + g * group;
+            for (std::uint32_t m = match(ctrl, t); m != 0; m &= m - 1)
+            {
+                std::size_t const i = g * group + std::countr_zero(m);
+                if (slots_[i].key == k)
+                    return i;
+            }
+            if (match(ctrl, empty) != 0)
+                return capacity_;
+            g = (g + step) & groups_mask; // triangular: visits every group
+        }
+    }
+
+    // first empty or deleted slot on k's probe sequence; there is one
+    auto free_index(std::uint64_t h) const -> std::size_t
+    {
+        std::size_t const groups_mask = capacity_ / group - 1;
+        std::size_t g = (h & groups_mask);
+        for (std::size_t step = 1; ; step++)
+        {
+            if (std::uint32_t const m = match_free(ctrl_.get() + g * group); m != 0)
+                return g * group + std::countr_zero(m);
+            g = (g + step) & groups_mask;
+        }
+    }
+
+    void rehash(std::size_t capacity)
+    {
+        auto old_ctrl = std::move(ctrl_);
+        auto old_slots = std::move(slots_);
+        std::size_t const old_capacity = capacity_;
+
+        ctrl_ = std::make_unique<std::int8_t[]>(capacity);
+        std::fill_n(ctrl_.get(), capacity, empty);
+        slots_ = std::make_unique<slot[]>(capacity);
+        capacity_ = capacity;
+        deleted_ = 0;
+
+        for (std::size_t i = 0; i < old_capacity; i++)
+            if (old_ctrl[i] >= 0)
+            {
+                std::uint64_t const h = old_slots[i].key.hash();
+                std::size_t const j = free_index(h);
+                ctrl_[j] = tag(h);
+                slots_[j] = std::move(old_slots[i]);
+            }
+    }
+
+public:
+    auto size() const -> std::size_t { return size_; }
+
+    auto find(topic_key const& k, std::uint64_t h) -> Value*
+    {
+        std::size_t const i = find_index(k, h);
+        return (i == capacity_)? nullptr: &slots_[i].value;
+    }
+
+    // the value of k, made with make() if k was absent
+    template<typename Make>
+    auto find_or_emplace(topic_key const& k, std::uint64_t h, Make && make) -> Value&
+    {
+        if (std::size_t const i = find_index(k, h); i != capacity_)
+            return slots_[i].value;
+
+        // at most 7/8 full, tombstones included
+        if ((size_ + deleted_ + 1) * 8 > capacity_ * 7)
+            rehash((size_ * 2 >= capacity_ / 2)? std::max<std::size_t>(capacity_ * 2, group * 4): capacity_);
+
+        std::size_t const i = free_index(h);
+        if (ctrl_[i] == deleted)
+            deleted_--;
+        ctrl_[i] = tag(h);
+        slots_[i].key = k;
+        slots_[i].value = std::forward<Make>(make)();
+        size_++;
+        return slots_[i].value;
+    }
+
+    // erases k if pred(value) holds; true if it did
+    template<typename Predicate>
+    bool erase_if(topic_key const& k, std::uint64_t h, Predicate && pred)
+    {
+        std::size_t const i = find_index(k, h);
+        if (i == capacity_ or not pred(slots_[i].value))
+            return false;
+        erase_at(i);
+        return true;
+    }
+
+    // erases every entry pred(key, value) holds for; returns how many
+    template<typename Predicate>
+    auto erase_if(Predicate && pred) -> std::size_t
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < capacity_; i++)
+            if (ctrl_[i] >= 0 and pred(slots_[i].key, slots_[i].value))
+            {
+                erase_at(i);
+                n++;
+            }
+        return n;
+    }
+
+    template<typename Function>
+    void for_each(Function && f)
+    {
+        for (std::size_t i = 0; i < capacity_; i++)
+            if (ctrl_[i] >= 0)
+                f(slots_[i].key, slots_[i].value);
+    }
+
+private:
+    void erase_at(std::size_t i)
+    {
+        slots_[i].value = Value{};
+        // a group that never filled up ends every probe through it, so
+        // its slots can go back to empty instead of becoming tombstones
+        std::size_t const g = i / group * group;
+        if (match(ctrl_.get() + g, empty) != 0)
+            ctrl_[i] = empty;
+        else
+        {
+            ctrl_[i] = deleted;
+            deleted_++;
+        }
+        size_--;
+    }
+};
+
+// flat_topic_map split into Shards by hash, each behind its own
+// shared_mutex on its own cache line. a lookup takes one shard's lock
+// shared; only an insert into that shard takes it exclusively
+template<typename Value, std::size_t Shards = 64>
+class topic_table
+{
+    static_assert(std::has_single_bit(Shards));
+
+    struct alignas(64) shard
+    {
+        std::shared_mutex mutex;
+        flat_topic_map<Value> map;
+    };
+
+    std::unique_ptr<shard[]> shards_ = std::make_unique<shard[]>(Shards);
+
+    static auto shard_of(std::uint64_t h) -> std::size_t { return (h >> 40) & (Shards - 1); }
+
+public:
+    // a copy of the value of k, made with make() if k was absent.
+    // one probe under a shared lock when k is there already
+    template<typename Make>
+    auto find_or_emplace(topic_key const& k, Make && make) -> Value
+    {
+        std::uint64_t const h = k.hash();
+        shard& s = shards_[shard_of(h)];
+        {
+            std::shared_lock lock{s.mutex};
+            if (Value* v = s.map.find(k, h))
+                return *v;
+        }
+        std::unique_lock lock{s.mutex};
+        return s.map.find_or_emplace(k, h, std::forward<Make>(make));
+    }
+
+    template<typename Predicate>
+    bool erase_if(topic_key const& k, Predicate && pred)
+    {
+        std::uint64_t const h = k.hash();
+        shard& s = shards_[shard_of(h)];
+        std::unique_lock lock{s.mutex};
+        return s.map.erase_if(k, h, std::forward<Predicate>(pred));
+    }
+
+    // pred(key, value) runs with the entry's shard locked exclusively
+    template<typename Predicate>
+    auto erase_if(Predicate && pred) -> std::size_t
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < Shards; i++)
+        {
+            std::unique_lock lock{shards_[i].mutex};
+            n += shards_[i].map.erase_if(pred);
+        }
+        return n;
+    }
+
+    // f(key, value) runs with the entry's shard locked shared
+    template<typename Function>
+    void for_each(Function && f)
+    {
+        for (std::size_t i = 0; i < Shards; i++)
+        {
+            std::shared_lock lock{shards_[i].mutex};
+            shards_[i].map.for_each(f);
+        }
+    }
+
+    auto size() -> std::size_t
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < Shards; i++)
+        {
+            std::shared_lock lock{shards_[i].mutex};
+            n += shards_[i].map.size();
+        }
+        return n;
+    }
+};
+
+} // namespace basic
+
+#endif // TOPIC_TABLE_HPP__
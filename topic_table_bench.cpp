@@ -0,0 +1,164 @@
+// lookup-or-insert throughput of the topic store implementations:
+//   tbb      the old oneapi::tbb::concurrent_unordered_map with contains + emplace + at
+//   locked   std::unordered_map behind one shared_mutex
+//   flat     basic::topic_table
+// usage: topic_table_bench [keys] [ops per thread] [threads]
+#include "serializer.hpp"
+#include "topic_table.hpp"
+
+#include <oneapi/tbb/concurrent_unordered_map.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+
+using value = std::shared_ptr<int>;
+
+struct tbb_store
+{
+    oneapi::tbb::concurrent_unordered_map<pack::packet_header, value,
+                                          pack::packet_header_key_hash,
+                                          pack::packet_header_key_compare> map;
+
+    auto get(pack::packet_header const& h) -> value
+    {
+        if (not map.contains(h))
+            map.emplace(h, std::make_shared<int>(0));
+        return map.at(h);
+    }
+};
+
+struct locked_store
+{
+    std::shared_mutex mutex;
+    std::unordered_map<pack::packet_header, value,
+                       pack::packet_header_key_hash, pack::packet_header_key_compare> map;
+
+    auto get(pack::packet_header const& h) -> value
+    {
+        {
+            std::shared_lock lock{mutex};
+            if (auto it = map.find(h); it != map.end())
+                return it->second;
+        }
+        std::unique_lock lock{mutex};
+        auto [it, inserted] = map.try_emplace(h, nullptr);
+        if (inserted)
+            it->second = std::make_shared<int>(0);
+        return it->second;
+    }
+};
+
+struct flat_store
+{
+    basic::topic_table<value> table;
+
+    auto get(pack::packet_header const& h) -> value
+    {
+        return table.find_or_emplace(basic::topic_key::of(h), [] { return std::make_shared<int>(0); });
+    }
+};
+
+auto make_headers(std::size_t n) -> std::vector<pack::packet_header>
+{
+    std::mt19937_64 gen{42};
+    std::vector<pack::packet_header> headers(n);
+    for (pack::packet_header& h : headers)
+    {
+        for (pack::unit_t& u : h.key)
+            u = static_cast<pack::unit_t>(gen());
+        for (pack::unit_t& u : h.random_salt)
+            u = static_cast<pack::unit_t>(gen());
+    }
+    return headers;
+}
+
+// ns per get with threads running ops gets each over random headers.
+// the indices are drawn before the clock starts, and the values read are
+// summed into checksum so the gets can not be optimized away
+template<typename Store>
+auto run(Store& store, std::vector<pack::packet_header> const& headers, std::size_t ops, unsigned threads,
+         std::size_t& checksum) -> double
+{
+    std::vector<std::vector<std::uint32_t>> picks(threads);
+    for (unsigned t = 0; t < threads; t++)
+    {
+        std::mt19937_64 gen{t};
+        std::uniform_int_distribution<std::uint32_t> pick(0, static_cast<std::uint32_t>(headers.size() - 1));
+        picks[t].resize(ops);
+        for (std::uint32_t& i : picks[t])
+            i = pick(gen);
+    }
+
+    std::atomic<std::size_t> sink = 0;
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> v;
+    for (unsigned t = 0; t < threads; t++)
+        v.emplace_back([&store, &headers, &sink, &indices = picks[t]] {
+            std::size_t sum = 0;
+            for (std::uint32_t const i : indices)
+                sum += *store.get(headers[i]);
+            sink.fetch_add(sum, std::memory_order_relaxed);
+        });
+    for (std::thread& th : v)
+        th.join();
+    auto const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    checksum = sink.load();
+    return ns / (static_cast<double>(ops) * threads);
+}
+
+template<typename Store>
+void bench(char const* name, std::vector<pack::packet_header> const& headers, std::size_t ops, unsigned threads)
+{
+    Store store;
+    auto const start = std::chrono::steady_clock::now();
+    for (pack::packet_header const& h : headers)
+        store.get(h);
+    auto const insert_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+                           / static_cast<double>(headers.size());
+
+    std::size_t checksum = 0;
+    double const hit_ns = run(store, headers, ops, threads, checksum);
+    std::cout << name << ": insert " << insert_ns << " ns, hit " << hit_ns << " ns/op with " << threads << " threads"
+              << " (checksum " << checksum << ")\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::size_t const keys = (argc > 1)? std::stoul(argv[1]): 1'000'000;
+    std::size_t const ops = (argc > 2)? std::stoul(argv[2]): 2'000'000;
+    unsigned const threads = (argc > 3)? std::stoul(argv[3]): std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<pack::packet_header> const headers = make_headers(keys);
+
+    // every store must find what it inserted, and only that
+    {
+        flat_store flat;
+        for (pack::packet_header const& h : headers)
+            *flat.get(h) += 1;
+        for (pack::packet_header const& h : headers)
+            if (*flat.get(h) != 1)
+            {
+                std::cerr << "topic_table lost or duplicated a key\n";
+                return EXIT_FAILURE;
+            }
+    }
+
+    std::cout << keys << " keys, " << ops << " gets per thread\n";
+    bench<tbb_store>("tbb", headers, ops, threads);
+    bench<locked_store>("locked", headers, ops, threads);
+    bench<flat_store>("flat", headers, ops, threads);
+    return EXIT_SUCCESS;
+}
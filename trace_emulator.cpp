@@ -65,7 +65,7 @@ void readtest (int const times, int const bufsize, std::function<int(int)> genpo
             7, 8, 7, 8, 7, 8, 7, 8,
             7, 8, 7, 8, 7, 8, 7, 9};
         std::string const payload = fmt::format("{{\"operation\": \"read\", \"filename\": \"/{}\", \"type\": \"file\", \"position\": {}, \"size\": {} }}", filename, genpos(i), buf.size());
-        std::copy(payload.begin(), payload.end(), std::back_inserter(ptr->data.buf));
+        std::copy(payload.begin(), payload.end(), ptr->data.allocate(payload.size()));
 
         ptr->header.gen();
         auto sendbuf = ptr->serialize();
@@ -110,7 +110,7 @@ void writetest (int const times, int const bufsize, std::function<int(int)> genp
             7, 8, 7, 8, 7, 8, 7, 8};
         std::string const payload = fmt::format("{{ \"operation\": \"write\", \"filename\": \"/{}\", \"type\": \"file\", \"position\": {}, \"size\": {}, \"data\": \"{}\" }}", filename, genpos(i), buf.size(), buf);
         //= std::string("{\"operation\": \"write\", \"filename\": \"/helloworld.txt\", \"type\": \"file\", \"position\": 0, \"size\": ") + buf.size() + ", \"data\": \"" + buf + "\"}";
-        std::copy(payload.begin(), payload.end(), std::back_inserter(ptr->data.buf));
+        std::copy(payload.begin(), payload.end(), ptr->data.allocate(payload.size()));
 
         ptr->header.gen();
         auto buf = ptr->serialize();
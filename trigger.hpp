@@ -4,6 +4,7 @@
 
 #include "basic.hpp"
 #include "serializer.hpp"
+#include "handler_memory.hpp"
 
 #include <boost/beast/ssl.hpp>
 #pragma GCC diagnostic push
@@ -114,12 +115,12 @@ public:
             httphost_.host, httphost_.port,
             net::bind_executor(
                 io_strand_,
-                [self=this->shared_from_this(), req](beast::error_code ec, tcp::resolver::results_type results) {
+                basic::recycled([self=this->shared_from_this(), req](beast::error_code ec, tcp::resolver::results_type results) {
                 if (not ec)
                     self->start_connect(results, req);
                 else
                     BOOST_LOG_TRIVIAL(error) << "start_connect error: " << ec.message();
-                }));
+                })));
     }
 
     void start_connect(tcp::resolver::results_type results, std::shared_ptr<http::request<http::string_body>> req)
@@ -162,7 +163,7 @@ public:
             stream_, *req,
             net::bind_executor(
                 io_strand_,
-                [self=this->shared_from_this(), req](beast::error_code ec, std::size_t /*bytes_transferred*/) {
+                basic::recycled([self=this->shared_from_this(), req](beast::error_code ec, std::size_t /*bytes_transferred*/) {
                     if (not ec)
                         self->start_read();
                     else if (self->retried_ < 3)
@@ -175,7 +176,7 @@ public:
                         BOOST_LOG_TRIVIAL(error) << "trigger start_write error: " << ec.message();
                         self->retried_ = 0;
                     }
-                }));
+                })));
     }
 
     void start_read()
@@ -183,7 +184,7 @@ public:
         auto res = std::make_shared<http::response<http::string_body>>();
         http::async_read(
             stream_, buffer_, *res,
-            [self=this->shared_from_this(), res](beast::error_code ec, std::size_t /*bytes_transferred*/) {
+            basic::recycled([self=this->shared_from_this(), res](beast::error_code ec, std::size_t /*bytes_transferred*/) {
                 if (not ec)
                 {
                     self->on_read_(res);
@@ -192,7 +193,7 @@ public:
                 }
                 else
                     BOOST_LOG_TRIVIAL(error) << "start_read error: " << ec.message();
-            });
+            }));
     }
 };
 
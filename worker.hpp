@@ -3,105 +3,300 @@
 #define WORKER_HPP__
 
 #include "basic.hpp"
+#include "compression.hpp"
+#include "flow_control.hpp"
+#include "handler_memory.hpp"
+#include "memfd.hpp"
+#include "read_buffer.hpp"
+#include "splice.hpp"
+#include "stream.hpp"
+#include "write_queue.hpp"
 
-#include <boost/signals2.hpp>
+#include <deque>
+#include <optional>
 
 namespace df
 {
 
 class worker : public std::enable_shared_from_this<worker>
 {
-    net::io_context::strand write_strand_;
-    tcp::socket socket_;
+    basic::stream_socket socket_;
+    basic::read_buffer reader_;
+    basic::write_queue<basic::stream_socket> write_queue_;
     bool valid_ = true;
-    using on_worker_response = boost::signals2::signal<void (pack::packet_pointer)>;
+    bool const compression_; // advertised with flag::compressed on worker_reg
+    bool const streams_;     // advertised with capability::streams in the worker_reg body
+
+    // bodies of at least memfd_min_size_ bytes are passed as a memfd, if the
+    // worker asked with flag::memfd on worker_reg and sits on a unix socket.
+    // fds_ holds descriptors received ahead of the frames they belong to
+    bool memfd_ = false;
+    std::size_t const memfd_min_size_;
+    std::deque<basic::memfd> fds_;
+
+    // streamed response being read. its pieces count against window_ until
+    // they are sent to the client; reading pauses while it is full
+    std::optional<basic::stream_state> response_;
+    std::shared_ptr<basic::watermark> window_;
+
+    using on_worker_response = basic::callback<void (pack::packet_pointer)>;
     on_worker_response on_worker_response_;
     on_worker_response on_worker_ack_;
 
+    // read_loop runs here; resume_ wakes it after a pause
+    using strand_type = net::strand<net::any_io_executor>;
+    template<typename T>
+    using awaitable = net::awaitable<T, strand_type>;
+    static constexpr net::use_awaitable_t<strand_type> use_awaitable{};
+
+    strand_type strand_;
+    net::steady_timer resume_;
+
 public:
     template<typename Launcher>
-    worker(net::io_context& io, tcp::socket socket, Launcher& l):
-        write_strand_{io},
-        socket_{std::move(socket)}
-        {
-            on_worker_response_.connect([&l] (pack::packet_pointer p) { l.on_worker_response(p); } );
-            on_worker_ack_.     connect([&l] (pack::packet_pointer p) { l.on_worker_ack(p); } );
-        }
+    worker(net::io_context& /*io*/, basic::stream_socket socket, basic::read_buffer reader, Launcher& l,
+           pack::packet const& request, std::size_t memfd_min_size, std::uint64_t stream_window):
+        socket_{std::move(socket)},
+        reader_{std::move(reader)},
+        write_queue_{socket_},
+        compression_{request.header.is_compressed()},
+        streams_{not request.data.buf.empty() and (request.data.buf.front() & pack::capability::streams)},
+        memfd_min_size_{memfd_min_size},
+        window_{std::make_shared<basic::watermark>(basic::limits{stream_window, stream_window / 2})},
+        on_worker_response_{[&l] (pack::packet_pointer p) { l.on_worker_response(p); }},
+        on_worker_ack_     {[&l] (pack::packet_pointer p) { l.on_worker_ack(p); }},
+        strand_{net::make_strand(socket_.get_executor())},
+        resume_{socket_.get_executor()} {}
 
     bool is_valid() { return valid_; }
+    bool takes_streams() const { return streams_; }
 
-    void start_read_header()
+    // answers a worker_reg that set flag::memfd. the ack carries flag::memfd
+    // if bodies will be passed that way; the worker must not send one
+    // itself before it has read this ack
+    void negotiate_memfd(pack::packet_pointer request)
     {
-        BOOST_LOG_TRIVIAL(trace) << "worker start_read_header";
-        auto read_buf = std::make_shared<std::array<pack::unit_t, pack::packet_header::bytesize>>();
-        net::async_read(
-            socket_,
-            net::buffer(read_buf->data(), read_buf->size()),
-            [self=shared_from_this(), read_buf] (boost::system::error_code ec, std::size_t /*length*/) {
-                if (not ec)
+        boost::system::error_code ec;
+        bool const local = socket_.local_endpoint(ec).protocol().family() == AF_UNIX and not ec;
+        memfd_ = basic::memfd::supported() and local and memfd_min_size_ != 0;
+        BOOST_LOG_TRIVIAL(info) << "worker asked for memfd bodies: " << (memfd_? "accepted": "refused");
+
+        pack::packet_pointer resp = pack::make_packet();
+        resp->header = request->header;
+        resp->header.type = pack::msg_t::ack;
+        resp->header.flags = memfd_? pack::flag::memfd: 0;
+        start_write(resp);
+    }
+
+    void start_read()
+    {
+        net::co_spawn(strand_, read_loop(shared_from_this()), net::detached);
+    }
+
+    // async_read_some that keeps descriptors passed along with the bytes
+    auto read_some(net::mutable_buffer b, boost::system::error_code& ec) -> awaitable<std::size_t>
+    {
+#ifdef __linux__
+        if (memfd_)
+            for (;;)
+            {
+                ssize_t const n = basic::receive_with_fds(socket_.native_handle(), b, fds_);
+                if (n > 0)
+                    co_return n;
+                if (n == 0)
                 {
-                    pack::packet_pointer pack = std::make_shared<pack::packet>();
-                    pack->header.parse(read_buf->data());
-
-                    switch (pack->header.type)
-                    {
-                    case pack::msg_t::worker_dereg:
-                        BOOST_LOG_TRIVIAL(debug) << "worker get worker_dereg" << pack->header;
-                        self->valid_ = false;
-                        self->start_read_header();
-                        break;
-
-                    case pack::msg_t::worker_response:
-                        BOOST_LOG_TRIVIAL(debug) << "worker get resp " << pack->header;
-                        self->start_read_body(pack);
-                        break;
-
-                    case pack::msg_t::ack:
-                        BOOST_LOG_TRIVIAL(debug) << "worker get ack " << pack->header;
-                        self->on_worker_ack_(pack);
-                        self->start_read_header();
-                        break;
-
-                    case pack::msg_t::err:
-                    case pack::msg_t::put:
-                    case pack::msg_t::get:
-                    case pack::msg_t::worker_reg:
-                    case pack::msg_t::worker_push_request:
-                    case pack::msg_t::trigger:
-                    {
-                        BOOST_LOG_TRIVIAL(error) << "worker packet error" << pack->header;
-                        self->start_read_header();
-                        break;
-                    }
-                    }
+                    ec = net::error::eof;
+                    co_return 0;
                 }
-                else
+                if (errno != EAGAIN and errno != EWOULDBLOCK)
                 {
-                    if (ec != boost::asio::error::eof)
-                        BOOST_LOG_TRIVIAL(error) << "worker start_read_header err: " << ec.message();
-                    self->valid_ = false;
+                    ec.assign(errno, boost::system::system_category());
+                    co_return 0;
                 }
-            });
+                co_await socket_.async_wait(basic::stream_socket::wait_read, net::redirect_error(use_awaitable, ec));
+                if (ec)
+                    co_return 0;
+            }
+#endif // __linux__
+        co_return co_await socket_.async_read_some(b, net::redirect_error(use_awaitable, ec));
     }
 
-    void start_read_body(pack::packet_pointer pack)
+    // fills [dst, dst + size), first from reader_
+    auto read_exactly(pack::unit_t* dst, std::size_t size, boost::system::error_code& ec) -> awaitable<void>
     {
-        BOOST_LOG_TRIVIAL(trace) << "worker start_read_body";
-        auto read_buf = std::make_shared<std::vector<pack::unit_t>>(pack->header.datasize);
-        net::async_read(
-            socket_,
-            net::buffer(read_buf->data(), read_buf->size()),
-            [self=shared_from_this(), read_buf, pack] (boost::system::error_code ec, std::size_t length) {
-                if (not ec)
+        std::size_t filled = reader_.take(dst, size);
+        while (filled < size and not ec)
+            filled += co_await read_some(net::buffer(dst + filled, size - filled), ec);
+    }
+
+    // decodes every frame already in reader_ before going back to the socket.
+    // self only keeps the worker alive while the coroutine runs
+    auto read_loop([[maybe_unused]] std::shared_ptr<worker> self) -> awaitable<void>
+    {
+        BOOST_LOG_TRIVIAL(trace) << "worker read_loop starts";
+        boost::system::error_code ec;
+        for (;;)
+        {
+            if (reader_.size() < pack::packet_header::bytesize)
+            {
+                std::size_t const length = co_await read_some(reader_.prepare(), ec);
+                if (ec)
+                {
+                    if (ec != boost::asio::error::eof)
+                        BOOST_LOG_TRIVIAL(error) << "worker read_loop err: " << ec.message();
+                    break;
+                }
+                reader_.commit(length);
+                continue;
+            }
+
+            pack::packet_pointer pack = pack::make_packet();
+            pack->header.parse(reader_.data());
+            reader_.consume(pack::packet_header::bytesize);
+
+            std::uint32_t const size = pack->header.datasize;
+            pack->data.compressed = pack->header.is_compressed();
+
+            if (pack->header.in_memfd())
+            {
+                if (not memfd_ or fds_.empty() or not fds_.front().read(size, pack->data))
                 {
-                    pack->data.parse(length, read_buf->data());
-                    BOOST_LOG_TRIVIAL(trace) << "worker start self->registered_job_";
-                    self->on_worker_response_(pack);
-                    self->start_read_header();
+                    BOOST_LOG_TRIVIAL(error) << "worker read_loop: no usable memfd for " << pack->header;
+                    break;
                 }
-                else
-                    BOOST_LOG_TRIVIAL(error) << "worker start_read_body: " << ec.message();
-            });
+                fds_.pop_front();
+                pack->header.flags &= ~pack::flag::memfd; // the body is inline from here on
+                on_frame(pack);
+                continue;
+            }
+
+            if (response_ and response_->continued_by(pack->header))
+            {
+                if (not co_await forward_chunk(pack->header, ec))
+                {
+                    BOOST_LOG_TRIVIAL(error) << "worker read_loop chunk: " << ec.message();
+                    break;
+                }
+                continue;
+            }
+
+            // the rest of a large body goes straight into its final buffer
+            pack::unit_t* const body = pack->data.allocate(size);
+            co_await read_exactly(body, size, ec);
+            if (ec)
+            {
+                BOOST_LOG_TRIVIAL(error) << "worker read_loop body: " << ec.message();
+                break;
+            }
+
+            on_frame(pack);
+        }
+
+        valid_ = false;
+        if (response_)
+        {
+            // the client would wait for the rest forever
+            pack::packet_pointer err = pack::make_packet();
+            err->header = response_->header;
+            err->header.type = pack::msg_t::err;
+            response_.reset();
+            on_worker_response_(err);
+        }
+    }
+
+    // passes a chunk of the streamed response on in pieces while it arrives,
+    // holding at most the window; returns false if the socket failed
+    auto forward_chunk(pack::packet_header const& chunk, boost::system::error_code& ec) -> awaitable<bool>
+    {
+        std::uint64_t left = chunk.datasize;
+        response_->remaining -= left;
+        while (left != 0)
+        {
+            if (window_->wait_if_blocked([self=shared_from_this()] { self->resume_reading(); }))
+            {
+                co_await pause_reading();
+                continue;
+            }
+
+            std::size_t const size = std::min<std::uint64_t>(left, basic::stream_piece_size);
+            pack::packet_pointer piece = basic::make_charged_packet(basic::charge{window_, nullptr, size});
+            piece->header = chunk;
+            pack::unit_t* const body = piece->data.allocate(size);
+            co_await read_exactly(body, size, ec);
+            if (ec)
+                co_return false;
+
+            on_worker_response_(piece);
+            left -= size;
+        }
+
+        if (response_->remaining == 0)
+            response_.reset();
+        co_return true;
+    }
+
+    // suspends read_loop until resume_reading()
+    auto pause_reading() -> awaitable<void>
+    {
+        boost::system::error_code ec;
+        resume_.expires_at(net::steady_timer::time_point::max());
+        co_await resume_.async_wait(net::redirect_error(use_awaitable, ec));
+    }
+
+    // read_loop only suspends on strand_, and the cancel is posted there too,
+    // so it can never run before the wait it is meant to end
+    void resume_reading()
+    {
+        net::post(strand_, basic::recycled([self=shared_from_this()] { self->resume_.cancel(); }));
+    }
+
+    void on_frame(pack::packet_pointer pack)
+    {
+        switch (pack->header.type)
+        {
+        case pack::msg_t::worker_dereg:
+            BOOST_LOG_TRIVIAL(debug) << "worker get worker_dereg" << pack->header;
+            valid_ = false;
+            break;
+
+        case pack::msg_t::worker_response:
+            BOOST_LOG_TRIVIAL(debug) << "worker get resp " << pack->header;
+            on_worker_response_(pack);
+            break;
+
+        case pack::msg_t::stream:
+        {
+            BOOST_LOG_TRIVIAL(debug) << "worker get resp stream " << pack->header;
+            pack::stream_header s;
+            if (response_ or not s.parse(pack->data.buf) or s.type != pack::msg_t::worker_response)
+            {
+                BOOST_LOG_TRIVIAL(error) << "worker bad stream " << pack->header;
+                break;
+            }
+            if (s.total != 0)
+                response_ = basic::stream_state{pack->header, s.total};
+            on_worker_response_(pack);
+            break;
+        }
+
+        case pack::msg_t::ack:
+            BOOST_LOG_TRIVIAL(debug) << "worker get ack " << pack->header;
+            on_worker_ack_(pack);
+            break;
+
+        case pack::msg_t::err:
+        case pack::msg_t::put:
+        case pack::msg_t::get:
+        case pack::msg_t::worker_reg:
+        case pack::msg_t::worker_push_request:
+        case pack::msg_t::trigger:
+        case pack::msg_t::chunk:
+        case pack::msg_t::batch:
+        case pack::msg_t::hello:
+        case pack::msg_t::key_bind:
+            BOOST_LOG_TRIVIAL(error) << "worker packet error" << pack->header;
+            break;
+        }
     }
 
     //template<typename OnCompletion>
@@ -109,24 +304,54 @@ public:
     {
         BOOST_LOG_TRIVIAL(trace) << "worker start post";
         //registered_job_[pack->header].connect(std::forward<OnCompletion>(oncomp));
+        if (pack->data.compressed and not compression_)
+        {
+            pack::packet_pointer plain = pack::make_packet();
+            plain->header = pack->header;
+            if (not pack::decompress(pack->data, plain->data))
+            {
+                BOOST_LOG_TRIVIAL(error) << "worker start post: bad compressed body " << pack->header;
+                return;
+            }
+            pack = plain;
+        }
+
+        if (memfd_ and pack->data.buf.size() >= memfd_min_size_)
+            if (basic::memfd body = basic::memfd::copy_of(pack->data.buf))
+            {
+                // the header is dumped from a copy: the job keeps this packet
+                // and may post it again to a worker that takes inline bodies
+                write_queue_.push(
+                    shared_from_this(), pack,
+                    [] (pack::packet_header h, pack::unit_t* pos) {
+                        h.flags |= pack::flag::memfd;
+                        return h.dump(pos);
+                    },
+                    std::move(body));
+                return;
+            }
         start_write(pack);
     }
 
+    // pack is a header only; its body of body->size() bytes is spliced in
+    void start_splice(pack::packet_pointer pack, std::shared_ptr<basic::spliced_body> body)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "worker start_splice";
+        write_queue_.push_spliced(
+            shared_from_this(), pack,
+            [size=body->size()] (pack::packet_header h, pack::unit_t* pos) {
+                h.datasize = static_cast<std::uint32_t>(size);
+                return h.dump(pos);
+            },
+            body);
+    }
+
     void start_write(pack::packet_pointer pack)
     {
         BOOST_LOG_TRIVIAL(trace) << "worker start_write";
-        auto buf_pointer = pack->serialize();
-        net::async_write(
-            socket_,
-            net::buffer(buf_pointer->data(), buf_pointer->size()),
-            net::bind_executor(
-                write_strand_,
-                [self=shared_from_this(), buf_pointer] (boost::system::error_code ec, std::size_t /*length*/) {
-                    if (not ec)
-                        BOOST_LOG_TRIVIAL(debug) << "worker wrote msg";
-                    else
-                        BOOST_LOG_TRIVIAL(error) << "worker start write error: " << ec.message();
-                }));
+        write_queue_.push(
+            shared_from_this(), pack,
+            [] (pack::packet_header const& h, pack::unit_t* pos) { return h.dump(pos); });
     }
 };
 
@@ -0,0 +1,313 @@
+#pragma once
+#ifndef WRITE_QUEUE_HPP__
+#define WRITE_QUEUE_HPP__
+
+#include "basic.hpp"
+#include "flow_control.hpp"
+#include "handler_memory.hpp"
+#include "memfd.hpp"
+#include "serializer.hpp"
+#include "splice.hpp"
+
+#include <mutex>
+#include <vector>
+
+namespace basic
+{
+
+// outbound packets of one socket. packets go out in push order and
+// only one async_write is in flight; everything queued while it runs
+// is sent by the next one as a single gather write. a packet whose body
+// is passed as a memfd ends such a run: its header goes out on its own
+// sendmsg, which carries the descriptor. so does one whose body is
+// spliced: its header is the last buffer of the run, then the body moves
+// from the pipe into the socket as the sender fills it.
+template<typename Socket>
+class write_queue
+{
+    struct entry
+    {
+        pack::packet_pointer pack;
+        pack::packet::header_buffer header;
+        std::size_t header_size;
+        basic::charge charge; // unsent bytes, released once written or dropped
+        memfd body_fd;        // if set, sent instead of the body
+        std::shared_ptr<spliced_body> body_splice; // if set, the body comes from here
+    };
+
+    // buffers_ as a sequence that is cheap to copy: async_write keeps a
+    // copy of its buffer sequence, and copying the vector would allocate
+    struct buffer_view
+    {
+        using value_type = net::const_buffer;
+        using const_iterator = net::const_buffer const*;
+
+        const_iterator first;
+        const_iterator last;
+
+        auto begin() const -> const_iterator { return first; }
+        auto end() const -> const_iterator { return last; }
+    };
+
+    Socket& socket_;
+    flow_control* flow_;
+    std::mutex mutex_;
+    std::vector<entry> pending_;
+    std::vector<entry> writing_;
+    std::vector<net::const_buffer> buffers_;
+    std::size_t sent_ = 0; // entries of writing_ already written
+    bool active_ = false;
+    bool failed_ = false;
+
+    // mutex_ must be held
+    void fail(boost::system::error_code ec)
+    {
+        for (std::vector<entry>* v : {&writing_, &pending_})
+            for (entry& e : *v)
+                if (e.body_splice)
+                    e.body_splice->abort();
+
+        BOOST_LOG_TRIVIAL(error) << "write_queue write error: " << ec.message();
+        failed_ = true;
+        active_ = false;
+        writing_.clear();
+        pending_.clear();
+        sent_ = 0;
+    }
+
+    // mutex_ must be held
+    void start_drain(std::shared_ptr<void> owner)
+    {
+        if (sent_ == writing_.size())
+        {
+            writing_.clear();
+            sent_ = 0;
+            if (pending_.empty())
+            {
+                active_ = false;
+                return;
+            }
+            std::swap(pending_, writing_);
+        }
+
+        if (writing_[sent_].body_fd)
+        {
+            start_send_fd(owner);
+            return;
+        }
+
+        std::size_t last = sent_;
+        buffers_.clear();
+        for (; last != writing_.size() and not writing_[last].body_fd; last++)
+        {
+            entry& e = writing_[last];
+            buffers_.push_back(net::buffer(e.header.data(), e.header_size));
+            if (e.body_splice)
+                break;
+            if (not e.pack->data.buf.empty())
+                buffers_.push_back(net::buffer(e.pack->data.buf.data(), e.pack->data.buf.size()));
+        }
+
+        BOOST_LOG_TRIVIAL(trace) << "write_queue drain " << last - sent_ << " packets";
+        net::async_write(
+            socket_,
+            buffer_view{buffers_.data(), buffers_.data() + buffers_.size()},
+            basic::recycled([this, owner, last] (boost::system::error_code ec, std::size_t /*length*/) {
+                std::scoped_lock lock{mutex_};
+                if (ec)
+                {
+                    fail(ec);
+                    return;
+                }
+
+                BOOST_LOG_TRIVIAL(debug) << "sent msg";
+                sent_ = last;
+                if (sent_ != writing_.size() and writing_[sent_].body_splice)
+                {
+                    // splice() must not block; asio may have left the socket blocking
+                    socket_.native_non_blocking(true, ec);
+                    start_splice(owner);
+                }
+                else
+                    start_drain(owner);
+            }));
+    }
+
+    // mutex_ must be held, and the header of writing_[sent_] sent.
+    // drains the pipe while there is something in it and the socket
+    // takes it; otherwise waits for whichever of the two is missing
+    void start_splice(std::shared_ptr<void> owner)
+    {
+#ifdef __linux__
+        spliced_body& body = *writing_[sent_].body_splice;
+        for (;;)
+        {
+            std::uint64_t const seen = body.produced();
+            ssize_t const n = body.drain_to(socket_.native_handle());
+            if (n > 0)
+            {
+                if (not body.drained())
+                    continue;
+                sent_++;
+                start_drain(owner);
+                return;
+            }
+
+            if (n < 0 and errno != EAGAIN and errno != EWOULDBLOCK)
+            {
+                fail(boost::system::error_code{errno, boost::system::system_category()});
+                return;
+            }
+
+            if (body.buffered() != 0)
+                break; // the socket is full
+
+            if (body.aborted())
+            {
+                // the frame can not be completed; the peer has to drop the connection
+                fail(net::error::connection_aborted);
+                boost::system::error_code ec;
+                socket_.shutdown(Socket::shutdown_both, ec);
+                return;
+            }
+
+            // posted: it may run from abort(), with mutex_ held
+            if (body.wait_for_data(seen, [this, owner] {
+                    net::post(socket_.get_executor(), basic::recycled([this, owner] {
+                        std::scoped_lock lock{mutex_};
+                        if (not failed_)
+                            start_splice(owner);
+                    }));
+                }))
+                return;
+        }
+
+        socket_.async_wait(
+            Socket::wait_write,
+            basic::recycled([this, owner] (boost::system::error_code ec) {
+                std::scoped_lock lock{mutex_};
+                if (ec)
+                    fail(ec);
+                else
+                    start_splice(owner);
+            }));
+#else
+        (void) owner;
+        fail(net::error::operation_not_supported);
+#endif // __linux__
+    }
+
+    // mutex_ must be held. the descriptor rides on the first byte the
+    // sendmsg takes; whatever is left of the header follows as a plain write
+    void start_send_fd(std::shared_ptr<void> owner)
+    {
+#ifdef __linux__
+        entry& e = writing_[sent_];
+        ssize_t const n = send_with_fd(socket_.native_handle(), e.header.data(), e.header_size,
+                                       e.body_fd.native_handle());
+        if (n < 0 and errno != EAGAIN and errno != EWOULDBLOCK)
+        {
+            fail(boost::system::error_code{errno, boost::system::system_category()});
+            return;
+        }
+
+        if (n < 0)
+        {
+            socket_.async_wait(
+                Socket::wait_write,
+                basic::recycled([this, owner] (boost::system::error_code ec) {
+                    std::scoped_lock lock{mutex_};
+                    if (ec)
+                        fail(ec);
+                    else
+                        start_send_fd(owner);
+                }));
+            return;
+        }
+
+        BOOST_LOG_TRIVIAL(debug) << "sent memfd " << e.pack->header;
+        if (static_cast<std::size_t>(n) == e.header_size)
+        {
+            sent_++;
+            start_drain(owner);
+            return;
+        }
+
+        net::async_write(
+            socket_,
+            net::buffer(e.header.data() + n, e.header_size - n),
+            basic::recycled([this, owner] (boost::system::error_code ec, std::size_t /*length*/) {
+                std::scoped_lock lock{mutex_};
+                if (ec)
+                {
+                    fail(ec);
+                    return;
+                }
+                sent_++;
+                start_drain(owner);
+            }));
+#else
+        (void) owner;
+        fail(net::error::operation_not_supported);
+#endif // __linux__
+    }
+
+public:
+    // flow, if set, counts queued bytes against the owner's outbound watermarks
+    write_queue(Socket& s, flow_control* flow = nullptr): socket_{s}, flow_{flow} {}
+
+    // encode(pack::packet_header const&, pack::unit_t* pos) -> pack::unit_t* dumps the
+    // header and returns its end. it runs here so the wire format is fixed at push time.
+    // it gets a copy of the header with datasize and the compressed flag set from the
+    // body; pack itself is never written, as it may be queued on other sockets too.
+    // owner keeps the socket alive until the queue is drained.
+    // body_fd, if set, goes out with SCM_RIGHTS in place of the body;
+    // the encoder has to mark the header with pack::flag::memfd.
+    template<typename Encoder>
+    void push(std::shared_ptr<void> owner, pack::packet_pointer pack, Encoder && encode, memfd body_fd = {})
+    {
+        entry e;
+        e.pack = pack;
+        e.body_fd = std::move(body_fd);
+        e.header_size = std::forward<Encoder>(encode)(pack->wire_header(), e.header.data()) - e.header.data();
+        if (flow_)
+            e.charge = flow_->charge_outbound(e.header_size + pack->data.buf.size());
+        enqueue(std::move(owner), std::move(e));
+    }
+
+    // pack has no body: it is spliced from body as the sender fills it,
+    // and the encoder has to put body->size() into datasize
+    template<typename Encoder>
+    void push_spliced(std::shared_ptr<void> owner, pack::packet_pointer pack, Encoder && encode,
+                      std::shared_ptr<spliced_body> body)
+    {
+        entry e;
+        e.pack = pack;
+        e.body_splice = std::move(body);
+        e.header_size = std::forward<Encoder>(encode)(pack->wire_header(), e.header.data()) - e.header.data();
+        enqueue(std::move(owner), std::move(e));
+    }
+
+private:
+    void enqueue(std::shared_ptr<void> owner, entry e)
+    {
+        std::scoped_lock lock{mutex_};
+        if (failed_)
+        {
+            if (e.body_splice)
+                e.body_splice->abort();
+            return;
+        }
+
+        pending_.push_back(std::move(e));
+        if (not active_)
+        {
+            active_ = true;
+            start_drain(owner);
+        }
+    }
+};
+
+} // namespace basic
+
+#endif // WRITE_QUEUE_HPP__